@@ -0,0 +1,388 @@
+// Benchmark suite comparing std::set, splay_tree and lazy_search_tree variants over a sweep of
+// workloads and sizes, reporting machine-readable results.
+
+// Every run executes in a child process of its own, so that its peak resident set size is its
+// own, and reports the total time, ns per operation, p50 and p99 latency of inserts and queries,
+// peak RSS and the number of heap allocations. Latency is timed on one operation in every
+// --sample-every, which keeps the clock out of the total time.
+
+// Usage: ./benchmark [--workloads uniform,clustered,zipf,sorted,reverse,pq,phases,ascending]
+//                    [--containers set,splay,lst,lst-flat,lst-adaptive] [--n 1000000]
+//                    [--q 0,1000,10000] [--k 1] [--zipf 1.0] [--repeat 1] [--sample-every 8]
+//                    [--format csv|json]
+// Lists sweep over every combination. For pq, q is the number of extractions after n pushes.
+// ascending inserts the upper half of the keys, queries them q times in ascending order, and then
+// inserts the lower half from the top down, so that every insert lands in front of the rest.
+
+#include "splay.cpp"
+#include "lazy-search-tree.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// every heap allocation made by the program goes through here to be counted. Each overload calls
+// malloc, posix_memalign or free itself, so news and deletes always pair up. The deletes are kept
+// out of line, so that GCC doesn't see their free next to a new and warn about a mismatch.
+static atomic<unsigned long> n_allocations(0);
+static atomic<unsigned long> allocated_bytes(0);
+
+static void* counted_alloc(size_t size, size_t alignment) {
+  ++n_allocations;
+  allocated_bytes += size;
+  if (!size) size = 1;
+  void *p = nullptr;
+  if (alignment <= alignof(max_align_t)) p = malloc(size);
+  else if (posix_memalign(&p, alignment, size)) p = nullptr;
+  if (!p) throw bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size) { return counted_alloc(size, 0); }
+void* operator new[](size_t size) { return counted_alloc(size, 0); }
+void* operator new(size_t size, align_val_t al) { return counted_alloc(size, (size_t)al); }
+void* operator new[](size_t size, align_val_t al) { return counted_alloc(size, (size_t)al); }
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p, size_t, align_val_t) noexcept { free(p); }
+
+// the operations a workload uses, over each container.
+struct set_container {
+  set<int> s;
+  void insert(int key) { s.insert(key); }
+  bool count(int key) { return s.count(key); }
+  int top() { return *s.begin(); }
+  void pop() { s.erase(s.begin()); }
+};
+
+struct splay_container {
+  splay_tree<int> s;
+  void insert(int key) { s.insert(key); }
+  bool count(int key) { return s.count(key); }
+  int top() { return s.minimum(); }
+  void pop() {
+    int key = s.minimum();
+    s.erase(key);
+  }
+};
+
+template<typename Tree>
+struct lst_container {
+  Tree s;
+  void insert(int key) { s.insert(key); }
+  bool count(int key) { return s.count(key); }
+  int top() { return s.top(); }
+  void pop() { s.pop(); }
+};
+
+struct config {
+  string workload, container;
+  int n, q, k;
+  double zipf_s;
+  int sample_every;
+  unsigned seed;
+};
+
+// what a run measures in its own process. Peak RSS is added by the parent.
+struct result {
+  double total_ms;
+  unsigned long n_ops;
+  double insert_p50, insert_p99, query_p50, query_p99;
+  unsigned long n_allocations, allocated_bytes;
+  long checksum;
+};
+
+// times one operation in every sample_every, keeping the latencies of inserts and queries apart.
+class recorder {
+private:
+  int sample_every;
+  unsigned long n;
+  vector<double> insert_ns, query_ns;
+
+  static double percentile(vector<double> &v, double p) {
+    if (v.empty()) return 0;
+    unsigned long i = min((unsigned long)(p * v.size()), (unsigned long)v.size() - 1);
+    nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+  }
+
+  template<typename F>
+  void run(F f, vector<double> &out) {
+    if (n++ % sample_every != 0) {
+      f();
+      return;
+    }
+    auto t1 = chrono::steady_clock::now();
+    f();
+    auto t2 = chrono::steady_clock::now();
+    out.push_back(chrono::duration<double, nano>(t2 - t1).count());
+  }
+
+public:
+  explicit recorder(int sample_every) : sample_every(max(sample_every, 1)), n(0) {}
+
+  template<typename F> void insert(F f) { run(f, insert_ns); }
+  template<typename F> void query(F f) { run(f, query_ns); }
+
+  unsigned long ops() const { return n; }
+
+  void report(result &r) {
+    r.insert_p50 = percentile(insert_ns, 0.50);
+    r.insert_p99 = percentile(insert_ns, 0.99);
+    r.query_p50 = percentile(query_ns, 0.50);
+    r.query_p99 = percentile(query_ns, 0.99);
+  }
+};
+
+// samples ranks in [0, n) with probability proportional to 1 / (rank + 1)^s.
+class zipf_distribution {
+private:
+  vector<double> cdf;
+
+public:
+  zipf_distribution(int n, double s) : cdf(n) {
+    double total = 0;
+    for (int i = 0; i < n; ++i) cdf[i] = total += 1 / pow(i + 1.0, s);
+    for (double &c : cdf) c /= total;
+  }
+
+  template<typename Gen>
+  int operator()(Gen &gen) {
+    double u = uniform_real_distribution<double>(0, 1)(gen);
+    return min((int)(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), (int)cdf.size() - 1);
+  }
+};
+
+// the insert order of a workload.
+vector<int> insert_order(const config &c, default_random_engine &gen) {
+  vector<int> keys(c.n);
+  for (int i = 0; i < c.n; ++i) keys[i] = i;
+  if (c.workload == "reverse") reverse(keys.begin(), keys.end());
+  else if (c.workload != "sorted") shuffle(keys.begin(), keys.end(), gen);
+  return keys;
+}
+
+template<typename Container>
+result run_workload(const config &c) {
+  default_random_engine gen(c.seed);
+  vector<int> keys = insert_order(c, gen);
+  Container container;
+  recorder rec(c.sample_every);
+  long checksum = 0;
+  uniform_int_distribution<int> uniform(0, max(c.n - 1, 0));
+  zipf_distribution zipf(c.workload == "zipf" ? c.n : 0, c.zipf_s);
+  unsigned long allocations_before = n_allocations, bytes_before = allocated_bytes;
+
+  auto t1 = chrono::steady_clock::now();
+  if (c.workload == "pq") {
+    for (int key : keys) rec.insert([&] { container.insert(key); });
+    for (int i = 0; i < c.q && i < c.n; ++i) {
+      rec.query([&] {
+        checksum += container.top();
+        container.pop();
+      });
+    }
+  } else if (c.workload == "phases") {
+    // four rounds of a quarter of the inserts followed by a quarter of the queries.
+    for (int phase = 0; phase < 4; ++phase) {
+      int inserted = c.n / 4 * (phase + 1) + (phase == 3 ? c.n % 4 : 0);
+      for (int i = c.n / 4 * phase; i < inserted; ++i) {
+        rec.insert([&] { container.insert(keys[i]); });
+      }
+      uniform_int_distribution<int> present(0, max(inserted - 1, 0));
+      for (int i = 0; i < c.q / 4; ++i) {
+        int key = keys[present(gen)];
+        rec.query([&] { checksum += container.count(key); });
+      }
+    }
+  } else if (c.workload == "ascending") {
+    // ascending queries leave a splayed index as a path down to its first key, which is where
+    // every one of the front inserts then has to look.
+    int half = c.n / 2;
+    for (int key : keys) {
+      if (key >= half) rec.insert([&] { container.insert(key); });
+    }
+    for (int i = 0; i < c.q; ++i) {
+      int key = half + (int)((long)(c.n - half) * i / c.q);
+      rec.query([&] { checksum += container.count(key); });
+    }
+    for (int key = half - 1; key >= 0; --key) rec.insert([&] { container.insert(key); });
+  } else {
+    // queries are interleaved with the inserts, q in total in batches of k consecutive keys.
+    int k = c.workload == "clustered" ? max(c.k, 1) : 1;
+    uniform_int_distribution<int> start(0, max(c.n - k, 0));
+    for (int key : keys) {
+      rec.insert([&] { container.insert(key); });
+      if (uniform(gen) < c.q / k) {
+        int first = c.workload == "zipf" ? zipf(gen) : start(gen);
+        for (int j = 0; j < k; ++j) {
+          rec.query([&] { checksum += container.count(first + j); });
+        }
+      }
+    }
+  }
+  auto t2 = chrono::steady_clock::now();
+
+  result r;
+  r.total_ms = chrono::duration<double, milli>(t2 - t1).count();
+  r.n_ops = rec.ops();
+  rec.report(r);
+  r.n_allocations = n_allocations - allocations_before;
+  r.allocated_bytes = allocated_bytes - bytes_before;
+  r.checksum = checksum;
+  return r;
+}
+
+bool run_config(const config &c, result &r) {
+  if (c.container == "set") r = run_workload<set_container>(c);
+  else if (c.container == "splay") r = run_workload<splay_container>(c);
+  else if (c.container == "lst") r = run_workload<lst_container<lazy_search_tree<int>>>(c);
+  else if (c.container == "lst-flat") {
+    r = run_workload<lst_container<lazy_search_tree<int, less<int>, flat_index>>>(c);
+  } else if (c.container == "lst-adaptive") {
+    r = run_workload<lst_container<lazy_search_tree<int, less<int>, splay_tree,
+                                                    adaptive_depth>>>(c);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// run c in a child process, returning false if it failed. peak_rss_kb is the child's peak.
+bool run_isolated(const config &c, result &r, long &peak_rss_kb) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    close(fds[0]);
+    bool ok = run_config(c, r);
+    if (ok && write(fds[1], &r, sizeof(r)) != (ssize_t)sizeof(r)) ok = false;
+    _exit(ok ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t n_read = read(fds[0], &r, sizeof(r));
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) return false;
+  peak_rss_kb = usage.ru_maxrss;
+  return n_read == (ssize_t)sizeof(r) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+vector<string> split_list(const string &s) {
+  vector<string> items;
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(',', start);
+    if (end == string::npos) end = s.size();
+    if (end > start) items.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+  return items;
+}
+
+vector<int> int_list(const string &s) {
+  vector<int> values;
+  for (const string &item : split_list(s)) values.push_back(atoi(item.c_str()));
+  return values;
+}
+
+int main(int argc, char *argv[]) {
+  vector<string> workloads = {"uniform", "clustered", "zipf", "sorted", "reverse", "pq", "phases",
+                              "ascending"};
+  vector<string> containers = {"set", "splay", "lst"};
+  vector<int> ns = {1000000}, qs = {0, 1000, 10000}, ks = {1};
+  double zipf_s = 1.0;
+  int repeat = 1, sample_every = 8;
+  string format = "csv";
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    string flag = argv[i], value = argv[i + 1];
+    if (flag == "--workloads") workloads = split_list(value);
+    else if (flag == "--containers") containers = split_list(value);
+    else if (flag == "--n") ns = int_list(value);
+    else if (flag == "--q") qs = int_list(value);
+    else if (flag == "--k") ks = int_list(value);
+    else if (flag == "--zipf") zipf_s = atof(value.c_str());
+    else if (flag == "--repeat") repeat = atoi(value.c_str());
+    else if (flag == "--sample-every") sample_every = atoi(value.c_str());
+    else if (flag == "--format") format = value;
+    else {
+      cerr << "Unknown option " << flag << endl;
+      return 1;
+    }
+  }
+  if (argc % 2 == 0) {
+    cerr << "Missing value for " << argv[argc - 1] << endl;
+    return 1;
+  }
+
+  bool json = format == "json";
+  if (json) {
+    cout << "[";
+  } else {
+    cout << "workload,container,n,q,k,run,total_ms,ns_per_op,insert_p50_ns,insert_p99_ns,"
+            "query_p50_ns,query_p99_ns,peak_rss_kb,allocations,allocated_bytes,checksum" << endl;
+  }
+  bool first = true;
+  for (const string &workload : workloads) {
+    for (int n : ns) {
+      for (int q : qs) {
+        for (int k : (workload == "clustered" ? ks : vector<int>{1})) {
+          for (const string &container : containers) {
+            for (int run = 0; run < repeat; ++run) {
+              config c{workload, container, n, q, k, zipf_s, sample_every, (unsigned)run};
+              result r;
+              long peak_rss_kb = 0;
+              if (!run_isolated(c, r, peak_rss_kb)) {
+                cerr << "Run failed: " << workload << " " << container << endl;
+                continue;
+              }
+              double ns_per_op = r.n_ops ? r.total_ms * 1e6 / r.n_ops : 0;
+              if (json) {
+                printf("%s\n  {\"workload\": \"%s\", \"container\": \"%s\", \"n\": %d, \"q\": %d, "
+                       "\"k\": %d, \"run\": %d, \"total_ms\": %.3f, \"ns_per_op\": %.1f, "
+                       "\"insert_p50_ns\": %.0f, \"insert_p99_ns\": %.0f, "
+                       "\"query_p50_ns\": %.0f, \"query_p99_ns\": %.0f, \"peak_rss_kb\": %ld, "
+                       "\"allocations\": %lu, \"allocated_bytes\": %lu, \"checksum\": %ld}",
+                       first ? "" : ",", workload.c_str(), container.c_str(), n, q, k, run,
+                       r.total_ms, ns_per_op, r.insert_p50, r.insert_p99, r.query_p50,
+                       r.query_p99, peak_rss_kb, r.n_allocations, r.allocated_bytes, r.checksum);
+              } else {
+                printf("%s,%s,%d,%d,%d,%d,%.3f,%.1f,%.0f,%.0f,%.0f,%.0f,%ld,%lu,%lu,%ld\n",
+                       workload.c_str(), container.c_str(), n, q, k, run, r.total_ms, ns_per_op,
+                       r.insert_p50, r.insert_p99, r.query_p50, r.query_p99, peak_rss_kb,
+                       r.n_allocations, r.allocated_bytes, r.checksum);
+              }
+              fflush(stdout);
+              first = false;
+            }
+          }
+        }
+      }
+    }
+  }
+  if (json) cout << endl << "]" << endl;
+  return 0;
+}
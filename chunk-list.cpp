@@ -0,0 +1,320 @@
+// Segmented storage for the elements of an interval. Elements live in fixed-capacity chunks handed
+// out by a chunk_pool, and a chunk_list keeps every chunk full except the last. That makes the
+// position of element i a division away, so intervals can be sampled in O(1) and scanned one
+// contiguous chunk at a time, while merging two lists only moves chunk pointers and at most one
+// chunk's worth of elements.
+
+#ifndef CHUNK_LIST
+#define CHUNK_LIST
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// hands out chunks of chunk_capacity elements, carved from larger blocks. Released chunks are kept
+// for reuse, so a structure that repeatedly splits and merges its storage stops allocating once
+// it has reached its peak size. Blocks may be shared with other pools, so that chunks can change
+// hands between structures without being copied, see share and absorb; a block is returned once
+// every pool sharing it has been destroyed. Storage the pool was only given, such as an adopted
+// buffer, is let go by drop_kept once no chunk of it is in use.
+template<typename T>
+class chunk_pool {
+public:
+  // chosen so a chunk spans 512 bytes, which keeps scans sequential without wasting much space
+  // in the many small intervals created by queries.
+  static constexpr unsigned long chunk_capacity = sizeof(T) >= 512 ? 1 : 512 / sizeof(T);
+
+private:
+  static constexpr unsigned long chunks_per_block = 64;
+
+  // a block carved into chunks, or an adopted buffer, and its owner. carved is set for the blocks
+  // this pool allocated itself.
+  struct block {
+    T *first;
+    std::shared_ptr<void> owner;
+    bool carved;
+  };
+
+  std::vector<block> blocks;
+  bool blocks_sorted = true;  // by first, which block_of needs for its search.
+  std::vector<T*> free_chunks;
+
+  void sort_blocks() {
+    if (blocks_sorted) return;
+    std::sort(blocks.begin(), blocks.end(), [](const block &a, const block &b) {
+      return std::less<T*>()(a.first, b.first);
+    });
+    blocks_sorted = true;
+  }
+
+  // the block holding chunk c. The blocks must be sorted.
+  const block& block_of(T *c) const {
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), c, [](T *p, const block &b) {
+      return std::less<T*>()(p, b.first);
+    });
+    return *--it;
+  }
+
+  // add the blocks in [first, last) that this pool doesn't already share.
+  void add_blocks(typename std::vector<block>::const_iterator first,
+                  typename std::vector<block>::const_iterator last) {
+    blocks.insert(blocks.end(), first, last);
+    blocks_sorted = false;
+    sort_blocks();
+    blocks.erase(std::unique(blocks.begin(), blocks.end(), [](const block &a, const block &b) {
+      return a.first == b.first;
+    }), blocks.end());
+  }
+
+public:
+  chunk_pool() {}
+  chunk_pool(const chunk_pool&) = delete;
+  chunk_pool& operator=(const chunk_pool&) = delete;
+
+  T* allocate() {
+    if (free_chunks.empty()) {
+      T *storage = new T[chunks_per_block * chunk_capacity];
+      blocks.push_back(block{storage, std::shared_ptr<void>(storage, [](void *p) {
+        delete[] static_cast<T*>(p);
+      }), true});
+      blocks_sorted = false;
+      for (unsigned long i = chunks_per_block; i-- > 0; ) {
+        free_chunks.push_back(storage + i * chunk_capacity);
+      }
+    }
+    T *chunk = free_chunks.back();
+    free_chunks.pop_back();
+    return chunk;
+  }
+
+  void release(T *chunk) {
+    free_chunks.push_back(chunk);
+  }
+
+  // take ownership of a buffer whose storage has been carved into chunks, keeping it alive until
+  // drop_kept. Those chunks are recycled like any other once released.
+  void keep(std::vector<T> &&buffer) {
+    if (buffer.empty()) return;
+    std::shared_ptr<std::vector<T>> owner = std::make_shared<std::vector<T>>(std::move(buffer));
+    keep(owner->data(), owner);
+  }
+
+  // as above, for storage starting at first that stays valid for as long as owner is held, such
+  // as a memory mapping.
+  void keep(T *first, std::shared_ptr<void> owner) {
+    blocks.push_back(block{first, std::move(owner), false});
+    blocks_sorted = false;
+  }
+
+  // share every block of other, so that other can hand any of its chunks over to this pool: they
+  // stay allocated until every pool holding them is destroyed, and are released to this pool.
+  // O(number of blocks), however many chunks change hands.
+  void share(const chunk_pool &other) {
+    std::vector<block> shared;
+    shared.reserve(other.blocks.size());
+    for (const block &b : other.blocks) shared.push_back(block{b.first, b.owner, false});
+    add_blocks(shared.begin(), shared.end());
+  }
+
+  // take over every block and free chunk of other, leaving it empty.
+  void absorb(chunk_pool &other) {
+    add_blocks(other.blocks.begin(), other.blocks.end());
+    free_chunks.insert(free_chunks.end(), other.free_chunks.begin(), other.free_chunks.end());
+    other.blocks.clear();
+    other.free_chunks.clear();
+  }
+
+  // let go of every block this pool didn't carve itself, that is every kept buffer and every
+  // block shared from another pool, along with their free chunks. None of their chunks may be in
+  // use. The blocks carved here stay for reuse.
+  void drop_kept() {
+    sort_blocks();
+    free_chunks.erase(std::remove_if(free_chunks.begin(), free_chunks.end(), [this](T *c) {
+      return !block_of(c).carved;
+    }), free_chunks.end());
+    blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [](const block &b) {
+      return !b.carved;
+    }), blocks.end());
+  }
+};
+
+// an unordered sequence of elements stored in chunks from a chunk_pool. The list doesn't remember
+// its pool; every operation that allocates or frees chunks is handed the pool explicitly.
+template<typename T>
+class chunk_list {
+public:
+  static constexpr unsigned long chunk_capacity = chunk_pool<T>::chunk_capacity;
+
+private:
+  std::vector<T*> chunks;
+  unsigned long count;
+
+public:
+  chunk_list() : count(0) {}
+
+  chunk_list(chunk_list &&other) : chunks(std::move(other.chunks)), count(other.count) {
+    other.chunks.clear();
+    other.count = 0;
+  }
+
+  chunk_list& operator=(chunk_list &&other) {
+    chunks.swap(other.chunks);
+    std::swap(count, other.count);
+    return *this;
+  }
+
+  unsigned long size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  T& operator[](unsigned long idx) { return chunks[idx / chunk_capacity][idx % chunk_capacity]; }
+  const T& operator[](unsigned long idx) const {
+    return chunks[idx / chunk_capacity][idx % chunk_capacity];
+  }
+
+  unsigned long n_chunks() const { return chunks.size(); }
+  T* chunk(unsigned long i) const { return chunks[i]; }
+
+  // number of elements held by chunk i.
+  unsigned long chunk_size(unsigned long i) const {
+    return i + 1 < chunks.size() ? chunk_capacity : count - i * chunk_capacity;
+  }
+
+  void push_back(chunk_pool<T> &pool, const T &e) {
+    unsigned long offset = count % chunk_capacity;
+    if (offset == 0) chunks.push_back(pool.allocate());
+    chunks.back()[offset] = e;
+    ++count;
+  }
+
+  // remove the last element, returning its chunk to the pool once it empties.
+  void pop_back(chunk_pool<T> &pool) {
+    --count;
+    if (count % chunk_capacity == 0) {
+      pool.release(chunks.back());
+      chunks.pop_back();
+    }
+  }
+
+  // append src[0, n), filling the partial last chunk before taking new ones from the pool.
+  void append(chunk_pool<T> &pool, const T *src, unsigned long n) {
+    while (n > 0) {
+      unsigned long offset = count % chunk_capacity;
+      if (offset == 0) chunks.push_back(pool.allocate());
+      unsigned long n_copy = std::min(n, chunk_capacity - offset);
+      std::copy(src, src + n_copy, chunks.back() + offset);
+      src += n_copy;
+      n -= n_copy;
+      count += n_copy;
+    }
+  }
+
+  // append the elements of buffer without copying them: every full chunk-sized slice of its
+  // storage becomes a chunk of this list and the pool takes ownership of the buffer. Only the
+  // final partial slice is copied.
+  void adopt(chunk_pool<T> &pool, std::vector<T> &&buffer) {
+    T *data = buffer.data();
+    unsigned long n = buffer.size();
+    if (n < chunk_capacity) {
+      append(pool, data, n);
+      return;
+    }
+    pool.keep(std::move(buffer));
+    attach(pool, data, n);
+  }
+
+  // append the n elements at data as adopt does, for storage the pool already keeps alive.
+  void attach(chunk_pool<T> &pool, T *data, unsigned long n) {
+    unsigned long n_full = n / chunk_capacity;
+
+    // full chunks go in front of a partial last chunk, if there is one.
+    auto pos = count % chunk_capacity == 0 ? chunks.end() : chunks.end() - 1;
+    std::vector<T*> slices(n_full);
+    for (unsigned long i = 0; i < n_full; ++i) slices[i] = data + i * chunk_capacity;
+    chunks.insert(pos, slices.begin(), slices.end());
+    count += n_full * chunk_capacity;
+    append(pool, data + n_full * chunk_capacity, n - n_full * chunk_capacity);
+  }
+
+  // append the elements of other, leaving it empty. Full chunks are moved by pointer; when both
+  // lists end in a partial chunk, the elements of one are moved into the other.
+  void splice(chunk_pool<T> &pool, chunk_list &other) {
+    if (other.empty()) return;
+    if (empty()) {
+      chunks.swap(other.chunks);
+      std::swap(count, other.count);
+      return;
+    }
+
+    unsigned long my_tail_n = chunk_size(chunks.size() - 1);
+    unsigned long other_tail_n = other.chunk_size(other.chunks.size() - 1);
+    T *my_tail = chunks.back();
+    T *other_tail = other.chunks.back();
+    chunks.pop_back();
+    other.chunks.pop_back();
+    chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+
+    // top up the fuller tail from the end of the other one.
+    if (my_tail_n < other_tail_n) {
+      std::swap(my_tail, other_tail);
+      std::swap(my_tail_n, other_tail_n);
+    }
+    unsigned long n_move = std::min(other_tail_n, chunk_capacity - my_tail_n);
+    std::copy(other_tail + other_tail_n - n_move, other_tail + other_tail_n, my_tail + my_tail_n);
+    other_tail_n -= n_move;
+    chunks.push_back(my_tail);
+    if (other_tail_n == 0) {
+      pool.release(other_tail);
+    } else {
+      chunks.push_back(other_tail);
+    }
+
+    count += other.count;
+    other.chunks.clear();
+    other.count = 0;
+  }
+
+  // move the elements from position idx on into other, which must be empty. The chunks past the
+  // one holding position idx are moved by pointer; only the elements of that chunk are copied.
+  void split(chunk_pool<T> &pool, unsigned long idx, chunk_list &other) {
+    unsigned long first_moved = (idx + chunk_capacity - 1) / chunk_capacity;
+    if (first_moved < chunks.size()) {
+      other.chunks.assign(chunks.begin() + first_moved, chunks.end());
+      other.count = count - first_moved * chunk_capacity;
+      chunks.resize(first_moved);
+    }
+    // the tail of the chunk holding position idx goes after the moved chunks, whose last chunk is
+    // the only one allowed to be partial.
+    unsigned long boundary_n = std::min(first_moved * chunk_capacity, count) - idx;
+    if (boundary_n > 0) other.append(pool, chunks.back() + idx % chunk_capacity, boundary_n);
+    count = idx;
+  }
+
+  // return every chunk to the pool, leaving the list empty.
+  void clear(chunk_pool<T> &pool) {
+    for (T *c : chunks) pool.release(c);
+    chunks.clear();
+    count = 0;
+  }
+
+  // hand each chunk and its element count to f, releasing the chunk to the pool as soon as f
+  // returns, and leave the list empty. Lets a consumer refill the same pool while it reads.
+  template<typename F>
+  void drain(chunk_pool<T> &pool, F f) {
+    std::vector<T*> old_chunks;
+    old_chunks.swap(chunks);
+    unsigned long remaining = count;
+    count = 0;
+    for (T *c : old_chunks) {
+      unsigned long n = std::min(remaining, chunk_capacity);
+      f(c, n);
+      remaining -= n;
+      pool.release(c);
+    }
+  }
+};
+
+template<typename T> constexpr unsigned long chunk_pool<T>::chunk_capacity;
+template<typename T> constexpr unsigned long chunk_pool<T>::chunks_per_block;
+template<typename T> constexpr unsigned long chunk_list<T>::chunk_capacity;
+
+#endif // CHUNK_LIST
@@ -0,0 +1,298 @@
+// A lazy search tree that can be used from many threads at once. The key space is partitioned into
+// ranges, each held by a shard: a lazy_search_tree behind its own mutex. An operation locks only
+// the shard its key falls in, so threads working on different key ranges never wait on each
+// other, and inserts, which are O(1) within a gap, scale with the number of shards.
+
+// Shards are split at their median as they grow, so a tree starts as a single shard and divides
+// itself along the key distribution it actually sees. Once max_shards is reached, a shard that
+// outgrows the rest makes room by merging the two smallest neighboring shards. Shards are split and
+// merged with lazy_search_tree::split and join, which hand whole gaps over without moving their
+// elements.
+
+// The routing table mapping keys to shards is replaced, never modified, when shards split or merge.
+// Readers load it without locking and check, under the shard lock, that the shard still covers
+// their key; if not, they retry with the new table. Replaced tables and retired shards are kept
+// until the tree is destroyed, as readers may still hold them.
+
+// An optional background thread refines the shards, doing the restructuring queries would otherwise
+// do, in slices taken only from shards no one else holds, so it works in the quiet periods.
+
+#ifndef CONCURRENT_LAZY_SEARCH_TREE
+#define CONCURRENT_LAZY_SEARCH_TREE
+
+#include "lazy-search-tree.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template<typename T, typename Comp = std::less<T>,
+         template<typename, typename, typename, typename> class GapIndex = splay_tree,
+         typename Restructure = fixed_depth<2>>
+class concurrent_lazy_search_tree {
+private:
+  // a shard holds the keys in [lo, hi), where a missing bound is unbounded.
+  struct shard {
+    std::mutex m;
+    lazy_search_tree<T, Comp, GapIndex, Restructure> lst;
+    bool has_lo, has_hi;
+    T lo, hi;
+    bool retired;
+    // mirrors lst.size(), so sizes can be read without taking the lock.
+    std::atomic<unsigned long> n;
+
+    explicit shard(const Comp &comp)
+        : lst(comp), has_lo(false), has_hi(false), lo(), hi(), retired(false), n(0) {}
+
+    bool covers(const T &key, const Comp &comp) const {
+      return !retired && (!has_lo || !comp(key, lo)) && (!has_hi || comp(key, hi));
+    }
+  };
+
+  // shards[i] holds the keys in [bounds[i-1], bounds[i]).
+  struct routing {
+    std::vector<T> bounds;
+    std::vector<shard*> shards;
+
+    shard* route(const T &key, const Comp &comp) const {
+      return shards[std::upper_bound(bounds.begin(), bounds.end(), key, comp) - bounds.begin()];
+    }
+  };
+
+  // a shard's size is checked against the others every this many inserts.
+  static const unsigned long check_interval = 1024;
+
+  Comp comp;
+  unsigned long max_shards;
+  unsigned long min_shard_size;
+
+  std::atomic<routing*> table;
+  // serializes changes to the routing table. Only its holder ever locks more than one shard.
+  std::mutex table_mutex;
+  std::vector<std::unique_ptr<shard>> all_shards;
+  std::vector<std::unique_ptr<routing>> all_tables;
+
+  std::thread refiner;
+  std::mutex refiner_m;
+  std::condition_variable refiner_wake;
+  bool refiner_stopping;
+
+  shard* new_shard() {
+    all_shards.emplace_back(new shard(comp));
+    return all_shards.back().get();
+  }
+
+  void publish(routing *next) {
+    all_tables.emplace_back(next);
+    table.store(next, std::memory_order_release);
+  }
+
+  // lock the shard covering key, retrying if a concurrent split or merge moved it.
+  std::unique_lock<std::mutex> lock_shard(const T &key, shard *&s) {
+    for (;;) {
+      s = table.load(std::memory_order_acquire)->route(key, comp);
+      std::unique_lock<std::mutex> lock(s->m);
+      if (s->covers(key, comp)) return lock;
+    }
+  }
+
+  // split shards[idx] of next at its median. Both shards must be locked by the caller.
+  void split(routing &next, unsigned long idx) {
+    shard *s = next.shards[idx];
+    T median = s->lst.select(s->lst.size() / 2);
+    shard *upper = new_shard();
+    s->lst.split(median, upper->lst);
+    upper->has_lo = true;
+    upper->lo = median;
+    upper->has_hi = s->has_hi;
+    upper->hi = s->hi;
+    upper->n.store(upper->lst.size(), std::memory_order_relaxed);
+    s->has_hi = true;
+    s->hi = median;
+    s->n.store(s->lst.size(), std::memory_order_relaxed);
+    next.bounds.insert(next.bounds.begin() + idx, median);
+    next.shards.insert(next.shards.begin() + idx + 1, upper);
+  }
+
+  // merge shards[idx + 1] of next into shards[idx]. Both must be locked by the caller.
+  void merge(routing &next, unsigned long idx) {
+    shard *a = next.shards[idx], *b = next.shards[idx + 1];
+    a->lst.join(b->lst);
+    a->has_hi = b->has_hi;
+    a->hi = b->hi;
+    a->n.store(a->lst.size(), std::memory_order_relaxed);
+    b->retired = true;
+    b->n.store(0, std::memory_order_relaxed);
+    next.bounds.erase(next.bounds.begin() + idx);
+    next.shards.erase(next.shards.begin() + idx + 1);
+  }
+
+  // split s if it has grown past twice its share of the elements, first merging the two smallest
+  // neighboring shards if there are already max_shards. Merging is skipped unless the merged
+  // shard ends up smaller than the halves of s, so the largest shard always shrinks.
+  void rebalance(shard *s) {
+    std::lock_guard<std::mutex> table_lock(table_mutex);
+    routing next(*table.load(std::memory_order_relaxed));
+    unsigned long idx = std::find(next.shards.begin(), next.shards.end(), s) - next.shards.begin();
+    if (idx == next.shards.size()) return;  // merged away in the meantime.
+
+    unsigned long total = 0;
+    for (shard *t : next.shards) total += t->n.load(std::memory_order_relaxed);
+    unsigned long target = std::max(min_shard_size, total / max_shards);
+    unsigned long s_size = s->n.load(std::memory_order_relaxed);
+    if (s_size <= 2 * target) return;
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (next.shards.size() >= max_shards) {
+      unsigned long best = next.shards.size(), best_size = 0;
+      for (unsigned long i = 0; i + 1 < next.shards.size(); ++i) {
+        if (i == idx || i + 1 == idx) continue;
+        unsigned long pair_size = next.shards[i]->n.load(std::memory_order_relaxed) +
+                                  next.shards[i+1]->n.load(std::memory_order_relaxed);
+        if (best == next.shards.size() || pair_size < best_size) {
+          best = i;
+          best_size = pair_size;
+        }
+      }
+      if (best == next.shards.size() || best_size >= s_size / 2) return;
+      locks.emplace_back(next.shards[best]->m);
+      locks.emplace_back(next.shards[best + 1]->m);
+      merge(next, best);
+      if (best < idx) --idx;
+    }
+
+    // s may have shrunk since it was measured.
+    locks.emplace_back(s->m);
+    if (s->lst.size() >= 2) split(next, idx);
+    publish(new routing(next));
+  }
+
+  // refine every shard that isn't locked by a slice of up to slice elements at a time, pausing
+  // for pause whenever a pass over the shards finds nothing to do.
+  void refine_loop(unsigned long slice, std::chrono::milliseconds pause) {
+    std::unique_lock<std::mutex> lock(refiner_m);
+    while (!refiner_stopping) {
+      lock.unlock();
+      unsigned long work = 0;
+      for (shard *s : table.load(std::memory_order_acquire)->shards) {
+        std::unique_lock<std::mutex> shard_lock(s->m, std::try_to_lock);
+        if (shard_lock.owns_lock() && !s->retired) work += s->lst.refine(slice);
+      }
+      lock.lock();
+      if (work == 0) refiner_wake.wait_for(lock, pause, [this] { return refiner_stopping; });
+    }
+  }
+
+public:
+  // a tree that splits shards once they hold more than twice min_shard_size elements, or twice
+  // their share of the elements once there are max_shards of them, and orders keys by comp.
+  explicit concurrent_lazy_search_tree(unsigned long max_shards = 256,
+                                       unsigned long min_shard_size = 1 << 16,
+                                       const Comp &comp = Comp())
+      : comp(comp), max_shards(std::max(max_shards, 1ul)), min_shard_size(min_shard_size),
+        refiner_stopping(false) {
+    routing *initial = new routing();
+    initial->shards.push_back(new_shard());
+    publish(initial);
+  }
+
+  // a tree whose shards start out split at the sorted, distinct keys in bounds, for when the
+  // key distribution is known ahead of time.
+  concurrent_lazy_search_tree(const std::vector<T> &bounds, unsigned long max_shards = 256,
+                              unsigned long min_shard_size = 1 << 16, const Comp &comp = Comp())
+      : comp(comp), max_shards(std::max(max_shards, (unsigned long)bounds.size() + 1)),
+        min_shard_size(min_shard_size), refiner_stopping(false) {
+    routing *initial = new routing();
+    initial->bounds = bounds;
+    for (unsigned long i = 0; i <= bounds.size(); ++i) {
+      shard *s = new_shard();
+      s->has_lo = i > 0;
+      if (s->has_lo) s->lo = bounds[i-1];
+      s->has_hi = i < bounds.size();
+      if (s->has_hi) s->hi = bounds[i];
+      initial->shards.push_back(s);
+    }
+    publish(initial);
+  }
+
+  concurrent_lazy_search_tree(const concurrent_lazy_search_tree&) = delete;
+  concurrent_lazy_search_tree& operator=(const concurrent_lazy_search_tree&) = delete;
+
+  ~concurrent_lazy_search_tree() { stop_refining(); }
+
+  // start a background thread that refines the shards, as lazy_search_tree::refine does, holding
+  // a shard for at most slice elements of work at a time and never waiting for a busy one. When
+  // there is nothing left to refine, it checks again every pause.
+  void start_refining(unsigned long slice = 1 << 16,
+                      std::chrono::milliseconds pause = std::chrono::milliseconds(10)) {
+    stop_refining();
+    refiner_stopping = false;
+    refiner = std::thread(&concurrent_lazy_search_tree::refine_loop, this, slice, pause);
+  }
+
+  // stop the background thread, if running, once its current slice is done.
+  void stop_refining() {
+    if (!refiner.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(refiner_m);
+      refiner_stopping = true;
+    }
+    refiner_wake.notify_all();
+    refiner.join();
+  }
+
+  // insert key, locking only its shard.
+  void insert(const T &key) {
+    shard *s;
+    unsigned long n;
+    {
+      std::unique_lock<std::mutex> lock = lock_shard(key, s);
+      s->lst.insert(key);
+      n = s->lst.size();
+      s->n.store(n, std::memory_order_relaxed);
+    }
+    if (n % check_interval == 0 && n > 2 * min_shard_size) rebalance(s);
+  }
+
+  // return if key is present, restructuring only the shard it falls in.
+  int count(const T &key) {
+    shard *s;
+    std::unique_lock<std::mutex> lock = lock_shard(key, s);
+    return s->lst.count(key);
+  }
+
+  // remove every element equal to key and return how many were removed.
+  unsigned long erase(const T &key) {
+    shard *s;
+    std::unique_lock<std::mutex> lock = lock_shard(key, s);
+    unsigned long removed = s->lst.erase(key);
+    s->n.store(s->lst.size(), std::memory_order_relaxed);
+    return removed;
+  }
+
+  // the number of elements. Exact only when no other thread is modifying the tree.
+  unsigned long size() const {
+    unsigned long total = 0;
+    for (shard *s : table.load(std::memory_order_acquire)->shards) {
+      total += s->n.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // the number of shards the key space is currently partitioned into.
+  unsigned long shard_count() const {
+    return table.load(std::memory_order_acquire)->shards.size();
+  }
+};
+
+template<typename T, typename Comp, template<typename, typename, typename, typename> class GapIndex,
+         typename Restructure>
+const unsigned long concurrent_lazy_search_tree<T, Comp, GapIndex, Restructure>::check_interval;
+
+#endif // CONCURRENT_LAZY_SEARCH_TREE
@@ -0,0 +1,380 @@
+// A flat, array-based ordered index with the same interface as splay_tree, meant as the gap index
+// of a lazy search tree when lookups far outnumber changes to the set of keys. Values live in
+// separately allocated slots that never move, so iterators stay valid until their value is erased,
+// while the keys they are ordered by are copied into a sorted array. Lookups search a copy of that
+// array in Eytzinger (BFS) order, which is branch-free and lets the next levels be prefetched.
+
+// Comp must provide a static key(value) returning what it orders values by, and must compare keys
+// to keys as well as to any type passed to locate or lower_bound_or_last. Values may be modified
+// in place as long as their order doesn't change, followed by a call to refresh.
+
+// Inserting or erasing a value shifts the arrays, O(n), and leaves the search layout and the
+// prefix weights to be rebuilt by the next call that needs them, so a burst of changes costs a
+// single rebuild. refresh is O(1).
+
+#ifndef FLAT_INDEX
+#define FLAT_INDEX
+
+#include "splay.cpp"
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// orders values by std::less, keying each value by itself.
+template<typename T>
+struct key_less {
+  static const T& key(const T &value) { return value; }
+  bool operator()(const T &a, const T &b) const { return a < b; }
+};
+
+template<typename T, typename Comp = key_less<T>, typename Alloc = pool_allocator<T>,
+         typename Weight = unit_weight>
+class flat_index {
+private:
+  typedef typename std::decay<decltype(Comp::key(std::declval<const T&>()))>::type key_type;
+
+  struct slot {
+    T value;
+    unsigned long pos;
+    unsigned long weight;
+    template<typename... Args>
+    explicit slot(Args&&... args) : value(std::forward<Args>(args)...), pos(0), weight(0) {}
+  };
+
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<slot> slot_allocator;
+  typedef std::allocator_traits<slot_allocator> slot_traits;
+
+  Comp comp;
+  Weight weight;
+  slot_allocator alloc;
+
+  // the slots and their keys, in sorted order.
+  std::vector<slot*> order;
+  std::vector<key_type> keys;
+  unsigned long total;
+
+  // the keys in Eytzinger order, 1-indexed, with the sorted position of each; and the Eytzinger
+  // index of each sorted position, so refresh can patch a key in place.
+  std::vector<key_type> eytzinger;
+  std::vector<unsigned long> eytzinger_pos, pos_eytzinger;
+  bool layout_valid;
+
+  // prefix[i] is the total weight of the first i slots.
+  std::vector<unsigned long> prefix;
+  bool prefix_valid;
+
+  template<typename... Args>
+  slot* create_slot(Args&&... args) {
+    slot *s = slot_traits::allocate(alloc, 1);
+    slot_traits::construct(alloc, s, std::forward<Args>(args)...);
+    return s;
+  }
+
+  // places the new slot s at its position in the order.
+  void insert_slot(slot *s) {
+    s->weight = weight(s->value);
+    const key_type &key = Comp::key(s->value);
+    unsigned long pos = insert_position(key);
+    order.insert(order.begin() + pos, s);
+    keys.insert(keys.begin() + pos, key);
+    total += s->weight;
+    renumber(pos);
+  }
+
+  void destroy_slot(slot *s) {
+    slot_traits::destroy(alloc, s);
+    slot_traits::deallocate(alloc, s, 1);
+  }
+
+  unsigned long build_layout(unsigned long k, unsigned long i) {
+    if (k > keys.size()) return i;
+    i = build_layout(2 * k, i);
+    eytzinger[k] = keys[i];
+    eytzinger_pos[k] = i;
+    pos_eytzinger[i] = k;
+    return build_layout(2 * k + 1, i + 1);
+  }
+
+  void ensure_layout() {
+    if (layout_valid) return;
+    eytzinger.resize(keys.size() + 1);
+    eytzinger_pos.resize(keys.size() + 1);
+    pos_eytzinger.resize(keys.size());
+    build_layout(1, 0);
+    layout_valid = true;
+  }
+
+  void ensure_prefix() {
+    if (prefix_valid) return;
+    prefix.resize(order.size() + 1);
+    prefix[0] = 0;
+    for (unsigned long i = 0; i < order.size(); ++i) prefix[i+1] = prefix[i] + order[i]->weight;
+    prefix_valid = true;
+  }
+
+  // renumber the slots from position first on, after the arrays have shifted.
+  void renumber(unsigned long first) {
+    for (unsigned long i = first; i < order.size(); ++i) order[i]->pos = i;
+    layout_valid = false;
+    prefix_valid = false;
+  }
+
+  // returns the position of the smallest key that compares >= key, or the last position if no
+  // larger key exists. Undefined behavior if the index is empty.
+  template<typename K>
+  unsigned long search(const K &key) {
+    ensure_layout();
+    const unsigned long n = keys.size();
+    const key_type *e = eytzinger.data();
+    // a cache line holds this many keys, so prefetching k times it fetches the line holding the
+    // descendants of k four levels down.
+    const unsigned long line = 64 / sizeof(key_type) > 0 ? 64 / sizeof(key_type) : 1;
+    unsigned long k = 1;
+    while (k <= n) {
+#if defined(__GNUC__)
+      __builtin_prefetch(e + k * line);
+#endif
+      k = 2 * k + (comp(e[k], key) ? 1 : 0);
+    }
+    // undo the right turns taken after the last left turn, which was at the lower bound.
+    k >>= __builtin_ffsl(~k);
+    return k == 0 ? n - 1 : eytzinger_pos[k];
+  }
+
+  // the position at which a new key is inserted: before any equal keys, as in splay_tree.
+  template<typename K>
+  unsigned long insert_position(const K &key) {
+    unsigned long lo = 0, hi = keys.size();
+    while (lo < hi) {
+      unsigned long mid = (lo + hi) / 2;
+      if (comp(keys[mid], key)) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+  void copy_from(const flat_index &other) {
+    for (slot *s : other.order) {
+      order.push_back(create_slot(s->value));
+      order.back()->weight = s->weight;
+    }
+    keys = other.keys;
+    total = other.total;
+    renumber(0);
+  }
+
+  // moves the slots of other from position first on to the end of this index. The slots themselves
+  // stay where they are, so this pool must already share other's.
+  void adopt_slots(flat_index &other, unsigned long first) {
+    unsigned long start = order.size();
+    for (unsigned long i = first; i < other.order.size(); ++i) {
+      total += other.order[i]->weight;
+      other.total -= other.order[i]->weight;
+    }
+    order.insert(order.end(), other.order.begin() + first, other.order.end());
+    keys.insert(keys.end(), other.keys.begin() + first, other.keys.end());
+    other.order.resize(first);
+    other.keys.resize(first);
+    renumber(start);
+    other.layout_valid = other.prefix_valid = false;
+  }
+
+public:
+  // a bidirectional iterator over the values in sorted order. Stays valid until its value is
+  // erased, no matter what else is inserted or erased.
+  class iterator {
+  private:
+    const flat_index *index;
+    slot *s;
+    friend class flat_index;
+    iterator(const flat_index *index, slot *s) : index(index), s(s) {}
+  public:
+    iterator() : index(nullptr), s(nullptr) {}
+    T& operator*() const { return s->value; }
+    T* operator->() const { return &s->value; }
+    iterator& operator++() {
+      s = s->pos + 1 < index->order.size() ? index->order[s->pos + 1] : nullptr;
+      return *this;
+    }
+    iterator& operator--() {
+      s = s->pos > 0 ? index->order[s->pos - 1] : nullptr;
+      return *this;
+    }
+    bool operator==(const iterator &other) const { return s == other.s; }
+    bool operator!=(const iterator &other) const { return s != other.s; }
+  };
+
+  flat_index() : total(0), layout_valid(false), prefix_valid(false) {}
+
+  // orders the values by comp.
+  explicit flat_index(const Comp &comp) : comp(comp), total(0), layout_valid(false),
+                                          prefix_valid(false) {}
+
+  flat_index(const flat_index &other) : comp(other.comp), weight(other.weight), total(0),
+                                        layout_valid(false), prefix_valid(false) {
+    copy_from(other);
+  }
+
+  flat_index(flat_index &&other) : comp(std::move(other.comp)), weight(std::move(other.weight)),
+                                   alloc(std::move(other.alloc)), total(other.total),
+                                   layout_valid(false), prefix_valid(false) {
+    order.swap(other.order);
+    keys.swap(other.keys);
+    other.total = 0;
+    other.layout_valid = other.prefix_valid = false;
+  }
+
+  flat_index& operator=(const flat_index &other) {
+    if (this != &other) {
+      clear();
+      comp = other.comp;
+      copy_from(other);
+    }
+    return *this;
+  }
+
+  flat_index& operator=(flat_index &&other) {
+    if (this != &other) {
+      clear();
+      comp = std::move(other.comp);
+      alloc = std::move(other.alloc);
+      order.swap(other.order);
+      keys.swap(other.keys);
+      std::swap(total, other.total);
+      layout_valid = prefix_valid = false;
+      other.layout_valid = other.prefix_valid = false;
+    }
+    return *this;
+  }
+
+  ~flat_index() { clear(); }
+
+  void clear() {
+    for (slot *s : order) destroy_slot(s);
+    order.clear();
+    keys.clear();
+    total = 0;
+    layout_valid = prefix_valid = false;
+  }
+
+  void insert(const T &value) { insert_slot(create_slot(value)); }
+
+  // moves value into the index rather than copying it.
+  void insert(T &&value) { insert_slot(create_slot(std::move(value))); }
+
+  // constructs the value in place from args.
+  template<typename... Args>
+  void emplace(Args&&... args) { insert_slot(create_slot(std::forward<Args>(args)...)); }
+
+  void erase(const T &value) {
+    if (empty()) return;
+    unsigned long pos = search(Comp::key(value));
+    if (comp(keys[pos], Comp::key(value)) || comp(Comp::key(value), keys[pos])) return;
+    erase(iterator(this, order[pos]));
+  }
+
+  // removes the value at it. Other iterators stay valid.
+  void erase(iterator it) {
+    unsigned long pos = it.s->pos;
+    total -= it.s->weight;
+    destroy_slot(it.s);
+    order.erase(order.begin() + pos);
+    keys.erase(keys.begin() + pos);
+    renumber(pos);
+  }
+
+  bool count(const T &value) {
+    if (empty()) return false;
+    unsigned long pos = search(Comp::key(value));
+    return !comp(keys[pos], Comp::key(value)) && !comp(Comp::key(value), keys[pos]);
+  }
+
+  // returns the smallest value that compares >= key, or the largest value if no larger value
+  // exists. Bad things happen if the index is empty.
+  template<typename K>
+  T& lower_bound_or_last(const K &key) { return order[search(key)]->value; }
+
+  const T& minimum() { return order.front()->value; }
+  const T& maximum() { return order.back()->value; }
+
+  iterator begin() { return iterator(this, order.empty() ? nullptr : order.front()); }
+  iterator end() { return iterator(); }
+
+  // returns an iterator to the smallest value that compares >= key, or to the largest value if no
+  // larger value exists. Returns end() on an empty index.
+  template<typename K>
+  iterator locate(const K &key) {
+    if (empty()) return end();
+    return iterator(this, order[search(key)]);
+  }
+
+  // the same as locate; a flat index has no shape to adjust, see splay_tree::locate_bounded.
+  template<typename K>
+  iterator locate_bounded(const K &key) { return locate(key); }
+
+  // must be called after *it changes in place, with its key still in order.
+  void refresh(iterator it) {
+    slot *s = it.s;
+    unsigned long w = weight(s->value);
+    total += w - s->weight;
+    s->weight = w;
+    keys[s->pos] = Comp::key(s->value);
+    if (layout_valid) eytzinger[pos_eytzinger[s->pos]] = keys[s->pos];
+    prefix_valid = false;
+  }
+
+  // returns an iterator to the value covering position k, when the values are laid out in sorted
+  // order and each occupies Weight(value) positions, and reduces k to the position within that
+  // value. Returns end() if k is at least the total weight.
+  iterator select(unsigned long &k) {
+    if (k >= total) return end();
+    ensure_prefix();
+    unsigned long lo = 0, hi = order.size() - 1;
+    while (lo < hi) {
+      unsigned long mid = (lo + hi + 1) / 2;
+      if (prefix[mid] <= k) lo = mid;
+      else hi = mid - 1;
+    }
+    k -= prefix[lo];
+    return iterator(this, order[lo]);
+  }
+
+  // returns the total weight of the values before *it.
+  unsigned long weight_before(iterator it) {
+    ensure_prefix();
+    return prefix[it.s->pos];
+  }
+
+  // returns the total weight of all values.
+  unsigned long total_weight() const { return total; }
+
+  // moves every value whose key compares >= key into right, which must be empty. Only the arrays
+  // are copied; the slots are handed over, and right shares this index's pool from then on.
+  template<typename K>
+  void split(const K &key, flat_index &right) {
+    right.alloc.share(alloc);
+    right.adopt_slots(*this, insert_position(key));
+  }
+
+  // moves every value of right, which must all be larger than the values of this index, to the
+  // end of this index, leaving right empty. The slots are handed over along with right's pool.
+  void join(flat_index &right) {
+    alloc.absorb(right.alloc);
+    adopt_slots(right, 0);
+  }
+
+  bool empty() const { return order.empty(); }
+  unsigned long size() const { return order.size(); }
+
+  // a flat index never rotates; this matches splay_tree::rotations.
+  unsigned long rotations() const { return 0; }
+
+  void print() {
+    for (slot *s : order) s->value.print();
+  }
+};
+
+#endif // FLAT_INDEX
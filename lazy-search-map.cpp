@@ -0,0 +1,116 @@
+// A map from keys to values built on a lazy search tree. The tree holds only small entries, each a
+// key and the index of its value in a separate payload deque, so pivots and membership scans move
+// and compare keys and never touch the values, which can be many times larger. Values stay where
+// they were written until their key is erased, and freed slots are reused by later inserts.
+
+// Keys are ordered by Comp and must be unique, as in the tree; insert doesn't check for an existing
+// key, so that it stays O(1) and never restructures. Use insert_or_assign when the key may already
+// be present. V must be default-constructible.
+
+#ifndef LAZY_SEARCH_MAP
+#define LAZY_SEARCH_MAP
+
+#include "lazy-search-tree.cpp"
+#include <deque>
+#include <utility>
+#include <vector>
+
+template<typename K, typename V, typename Comp = std::less<K>,
+         template<typename, typename, typename, typename> class GapIndex = splay_tree,
+         typename Restructure = fixed_depth<2>>
+class lazy_search_map {
+private:
+  // a key and the slot of its value in values.
+  struct entry {
+    K key;
+    unsigned slot;
+  };
+
+  struct entry_less {
+    Comp comp;
+    explicit entry_less(const Comp &comp = Comp()) : comp(comp) {}
+    bool operator()(const entry &a, const entry &b) const { return comp(a.key, b.key); }
+  };
+
+  lazy_search_tree<entry, entry_less, GapIndex, Restructure> keys;
+  // a deque, so that appending a value never moves the others and pointers from find stay valid.
+  std::deque<V> values;
+  std::vector<unsigned> free_slots;
+
+  // an entry to search for key with; the slot is ignored by the comparisons.
+  static entry probe(const K &key) { return entry{key, 0}; }
+
+  unsigned store(V value) {
+    if (free_slots.empty()) {
+      values.push_back(std::move(value));
+      return (unsigned)(values.size() - 1);
+    }
+    unsigned slot = free_slots.back();
+    free_slots.pop_back();
+    values[slot] = std::move(value);
+    return slot;
+  }
+
+  void release(unsigned slot) {
+    values[slot] = V();
+    free_slots.push_back(slot);
+  }
+
+public:
+  // order the keys by comp.
+  explicit lazy_search_map(const Comp &comp = Comp()) : keys(entry_less(comp)) {}
+
+  // insert key with value. Undefined behavior if key is already present.
+  void insert(const K &key, V value) {
+    keys.insert(entry{key, store(std::move(value))});
+  }
+
+  // set the value of key, inserting it if it isn't present, and return if it was inserted. Unlike
+  // insert, this is a query and restructures around key.
+  bool insert_or_assign(const K &key, V value) {
+    entry *e = keys.find(probe(key));
+    if (e) {
+      values[e->slot] = std::move(value);
+      return false;
+    }
+    insert(key, std::move(value));
+    return true;
+  }
+
+  // return a pointer to the value of key, or nullptr if it isn't present, restructuring around
+  // key as lazy_search_tree::count does. The pointer stays valid until key is erased.
+  V* find(const K &key) {
+    entry *e = keys.find(probe(key));
+    return e ? &values[e->slot] : nullptr;
+  }
+
+  // return if key is present, restructuring around it.
+  int count(const K &key) {
+    return keys.count(probe(key));
+  }
+
+  // remove key and its value, returning the number of elements removed.
+  unsigned long erase(const K &key) {
+    std::vector<entry> removed;
+    keys.extract(probe(key), removed);
+    for (const entry &e : removed) release(e.slot);
+    return removed.size();
+  }
+
+  void clear() {
+    keys.clear();
+    values.clear();
+    free_slots.clear();
+  }
+
+  // do up to about max_elements worth of restructuring ahead of queries, see
+  // lazy_search_tree::refine.
+  unsigned long refine(unsigned long max_elements) {
+    return keys.refine(max_elements);
+  }
+
+  unsigned long size() const { return keys.size(); }
+  bool empty() const { return keys.empty(); }
+};
+
+#endif // LAZY_SEARCH_MAP
@@ -1,7 +1,7 @@
 // An implementation of the lazy search tree data structure, from the paper "Lazy Search Trees"
 // by Bryce Sandlund and Sebastian Wild. A splay tree is used as the data structure for the gaps
-// and a linked list of vectors is the data structure for the intervals, which allows O(1) time
-// merge, insert, and delete while maintaining the O(min(n, q log n)) pointer bound.
+// and a list of fixed-size chunks from a per-tree pool is the data structure for the intervals,
+// which allows O(1) insert and sampling and merges that move chunk pointers rather than elements.
 
 // Currently assumes inserted elements are unique. The only part that requires this is the splay
 // tree. It compares based on the maximum element in a gap. If there's a gap with all x, and
@@ -15,21 +15,139 @@
 #define INF 1000000000
 
 #include "splay.cpp"
+#include "flat-index.cpp"
+#include "chunk-list.cpp"
+#include "simd-kernels.cpp"
+#include "thread-pool.cpp"
+#include "restructure-policy.cpp"
 #include <vector>
-#include <list>
 #include <algorithm>
+#include <cassert>
 #include <cstdlib>
 #include <memory>
 #include <iostream>
+#include <queue>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-//TODO: make sure Comp is being used on elements of type T, don't believe it's correct atm.
-template<typename T, typename Comp = std::less<T>>
+// counts of the restructuring work a tree has done. They are only kept when compiled with
+// LST_STATS, so that the counting costs nothing otherwise, and are all zero if not.
+struct lst_counters {
+  unsigned long pivots = 0;            // intervals partitioned around one or more pivots.
+  unsigned long elements_pivoted = 0;  // elements moved by those partitions.
+  unsigned long splits = 0;            // levels of split recursion after a query's pivot.
+  unsigned long max_split_depth = 0;   // the deepest of those recursions.
+  unsigned long interval_merges = 0;   // intervals merged into a neighbor by rebalancing.
+  unsigned long gap_merges = 0;        // gaps merged into a neighbor after erasing left them small.
+  unsigned long rotations = 0;         // rotations of the gap index, if it is a splay tree.
+};
+
+// a snapshot of a tree, returned by lazy_search_tree::stats: the counters since the tree was
+// created or last reset, and its current shape, which is always filled in.
+struct lst_stats : lst_counters {
+  unsigned long size = 0, n_gaps = 0, n_intervals = 0, largest_interval = 0;
+  // interval_sizes[i] is the number of intervals with between 2^i and 2^(i+1) - 1 elements.
+  vector<unsigned long> interval_sizes;
+};
+
+// the start of a snapshot written by lazy_search_tree::save. It is followed by sections laid out by
+// lazy_search_tree::snapshot_layout, each starting at a multiple of snapshot_align bytes:
+//   uint64_t gap_bounds[n_gaps + 1]            gap i holds intervals [gap_bounds[i], gap_bounds[i+1])
+//   double   gap_hits[n_gaps]                  the queries that landed in each gap
+//   uint64_t interval_bounds[n_intervals + 1]  interval i holds elements [bounds[i], bounds[i+1])
+//   T        interval_maxima[n_intervals]
+//   T        elements[n_elements]              the intervals in order, each unsorted
+// Gaps and intervals are in sorted order. Snapshots are only read back on the machine and build
+// that wrote them.
+struct lst_snapshot_header {
+  char magic[8];
+  uint64_t element_size;  // sizeof(T), checked on load.
+  uint64_t n_gaps, n_intervals, n_elements;
+};
+
+#ifdef LST_STATS
+#define LST_COUNT(counter, n) (ctx->counters.counter += (n))
+#else
+#define LST_COUNT(counter, n) ((void)0)
+#endif
+
+// how intervals choose the element to pivot around. Sampled pivots are cheap but may split
+// unevenly; taking the median of more samples evens out the splits at the cost of a few more
+// reads, and median_of_medians guarantees that each side gets at least 30% of the elements, even
+// on adversarial input, for a pass over the interval.
+enum class pivot_rule {
+  single_sample,      // a single random element.
+  median_of_k,        // the median of k random elements.
+  ninther,            // the median of the medians of three groups of three random elements.
+  median_of_medians   // the median of the medians of all groups of five, deterministic.
+};
+
+// xorshift64*, a small, fast generator for sampling pivots. Each tree has its own, so sampling
+// never contends on the global state of rand().
+struct xorshift {
+  unsigned long long state;
+  
+  explicit xorshift(unsigned long long seed = 0x9E3779B97F4A7C15ull) : state(seed ? seed : 1) {}
+  
+  unsigned long long next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+  }
+  
+  // a number in [0, n), by multiplying rather than dividing.
+  unsigned long below(unsigned long n) {
+    return (unsigned long)(((unsigned __int128)next() * n) >> 64);
+  }
+};
+
+// GapIndex is the ordered index over the gaps: splay_tree, which adapts to skewed access, or
+// flat_index, which searches a cache-friendly array and suits workloads dominated by inserts.
+// Restructure is the policy deciding how deeply queries restructure, see restructure-policy.cpp.
+// Every comparison of elements goes through the Comp the tree was constructed with, which is kept
+// in its context and copied into the gap index; elements are equal when neither comes before the
+// other. The vectorized kernels are only used with std::less.
+template<typename T, typename Comp = std::less<T>,
+         template<typename, typename, typename, typename> class GapIndex = splay_tree,
+         typename Restructure = fixed_depth<2>>
 class lazy_search_tree {
 private:
-  Comp comp;
   unsigned long lst_size;
+  Restructure restructure_policy;
+  
+  // state shared by all the intervals of a tree.
+  struct context {
+    Comp comp;
+    chunk_pool<T> chunks;
+    
+    // if set, intervals of at least parallel_threshold elements are pivoted by these workers.
+    thread_pool *workers;
+    unsigned long parallel_threshold;
+    
+    pivot_rule rule;
+    unsigned pivot_samples;  // k, for median_of_k.
+    xorshift rng;
+    
+    lst_counters counters;
+    
+    explicit context(const Comp &comp) : comp(comp), workers(nullptr), parallel_threshold(1 << 20),
+                                         rule(pivot_rule::single_sample), pivot_samples(5) {}
+    
+    bool before(const T &a, const T &b) const { return comp(a, b); }
+    bool equivalent(const T &a, const T &b) const { return !comp(a, b) && !comp(b, a); }
+    const T& larger(const T &a, const T &b) const { return comp(a, b) ? b : a; }
+  };
   
   // data structure that contains a set of intervals within a gap.
   class gap {
@@ -38,106 +156,394 @@ private:
     class interval {
     private:
       T max_e;
-      unsigned long int_size;
+      context *ctx;
       
-      // intervals require a linked list data structure for O(1) merging, but by using a linked list of
-      // vectors, we can take advantage of larger built intervals and inserted elements, reducing the
-      // number of pointers in the entire data structure to O(min(n, q log n)).
-      list<vector<T>> elements;
+      // intervals are stored as fixed-size chunks drawn from a per-tree pool. Every chunk but the
+      // last is full, so sampling is O(1), scans run over contiguous memory, merging moves chunk
+      // pointers rather than elements, and pivoting recycles chunks instead of allocating.
+      chunk_list<T> elements;
       
     public:
-      // returns an element uniformly at random from the interval. Time complexity is no worse
-      // than linear in the size of the interval, but typically more like logarithmic. (Can we
-      // derive a more rigorous bound here?)
+      // create an empty interval.
+      interval(context *ctx) : ctx(ctx) {}
+      
+      // create an interval with a single element.
+      interval(context *ctx, const T &element) : max_e(element), ctx(ctx) {
+        elements.push_back(ctx->chunks, element);
+      }
+      
+      // create an interval that takes over the storage of a non-empty vector.
+      interval(context *ctx, vector<T> &&starting_elements) : ctx(ctx) {
+        max_e = *max_element(starting_elements.begin(), starting_elements.end(), ctx->comp);
+        elements.adopt(ctx->chunks, std::move(starting_elements));
+      }
+      
+      // create an interval over the n elements at first, which belong to storage the pool keeps
+      // alive, such as a loaded snapshot. Its full chunks point into that storage.
+      interval(context *ctx, T *first, unsigned long n, const T &max) : max_e(max), ctx(ctx) {
+        elements.attach(ctx->chunks, first, n);
+      }
+      
+      interval(const interval&) = delete;
+      interval& operator=(const interval&) = delete;
+      
+      ~interval() {
+        elements.clear(ctx->chunks);
+      }
+      
+      // returns an element uniformly at random from the interval in O(1) time.
       T sample() {
-        int idx = rand()%size();
-        for (vector<T>& vec : elements) {
-          if (idx < vec.size()) {
-            return vec[idx];
+        return elements[ctx->rng.below(size())];
+      }
+      
+      // returns the element to pivot around, according to ctx->rule. Undefined behavior if the
+      // interval is empty.
+      T choose_pivot() {
+        switch (ctx->rule) {
+          case pivot_rule::median_of_k:
+            return median_of_samples(max(ctx->pivot_samples, 1u));
+          case pivot_rule::ninther: {
+            T medians[3];
+            for (T &m : medians) m = median_of_samples(3);
+            return median3(medians[0], medians[1], medians[2]);
           }
-          idx -= vec.size();
+          case pivot_rule::median_of_medians:
+            return median_of_medians();
+          default:
+            return sample();
         }
-        return T();
       }
       
-      // merges 'other' into this interval, destroying 'other'.
-      void merge(shared_ptr<interval> other) {
-        int_size += other->int_size;
-        max_e = max(max_e, other->max_e);
-        
-        // may want to make this conditional so that the interval is loosely structured in order, that
-        // is, if other is a left side interval, do as below, otherwise, add the elements to the
-        // beginning, not end.
-        elements.splice(elements.end(), other->elements);
-        other->int_size = 0;  // shouldn't matter but doing it anyway.
+      T median3(const T &a, const T &b, const T &c) const {
+        if (ctx->before(a, b)) return ctx->before(b, c) ? b : (ctx->before(a, c) ? c : a);
+        return ctx->before(a, c) ? a : (ctx->before(b, c) ? c : b);
+      }
+      
+      T median_of_samples(unsigned k) {
+        vector<T> samples(k);
+        for (T &s : samples) s = sample();
+        nth_element(samples.begin(), samples.begin() + k / 2, samples.end(), ctx->comp);
+        return samples[k / 2];
+      }
+      
+      // the median of the medians of consecutive groups of five elements. At least 3/10 of the
+      // elements are on either side of it.
+      T median_of_medians() {
+        vector<T> medians;
+        medians.reserve(size() / 5 + 1);
+        T group[5];
+        for (unsigned long i = 0; i < size(); i += 5) {
+          unsigned long n = min(size() - i, 5ul);
+          for (unsigned long j = 0; j < n; ++j) group[j] = elements[i + j];
+          nth_element(group, group + n / 2, group + n, ctx->comp);
+          medians.push_back(group[n / 2]);
+        }
+        nth_element(medians.begin(), medians.begin() + medians.size() / 2, medians.end(),
+                    ctx->comp);
+        return medians[medians.size() / 2];
+      }
+      
+      // merges 'other' into this interval, leaving 'other' empty.
+      void merge(interval &other) {
+        LST_COUNT(interval_merges, 1);
+        max_e = ctx->larger(max_e, other.max_e);
+        elements.splice(ctx->chunks, other.elements);
       }
       
       // insert an element into this interval.
       void insert(const T &element) {
-        elements.front().emplace_back(element); // doesn't actually matter which vector the element
-                                                // is placed into.
-        max_e = max(max_e, element);
-        ++int_size;
+        if (empty() || ctx->before(max_e, element)) max_e = element;
+        elements.push_back(ctx->chunks, element);
       }
       
-      // create an interval from a vector of type T.
-      interval(vector<T> &starting_elements) {
-        int_size = starting_elements.size();
-        if (!starting_elements.empty()) {
-          elements.emplace_back(starting_elements);
-          max_e = *max_element(starting_elements.begin(), starting_elements.end());
+      // remove every element for which pred holds, returning how many were removed and appending
+      // them to out unless it is null. Each one is overwritten by the last element, so removal is
+      // O(1) once found and the chunks stay full.
+      template<typename Pred>
+      unsigned long erase_if(Pred pred, vector<T> *out) {
+        unsigned long removed = 0, i = 0;
+        bool any_kept = false;
+        T kept_max = T();
+        while (i < elements.size()) {
+          if (pred(elements[i])) {
+            if (out) out->push_back(elements[i]);
+            elements[i] = elements[elements.size() - 1];
+            elements.pop_back(ctx->chunks);
+            ++removed;
+          } else {
+            if (!any_kept || ctx->before(kept_max, elements[i])) kept_max = elements[i];
+            any_kept = true;
+            ++i;
+          }
         }
+        if (any_kept) max_e = kept_max;
+        return removed;
       }
       
-      // create an interval with a single element.
-      interval(const T &element) {
-        int_size = 1;
-        elements.emplace_back(vector<T>({element}));
-        max_e = element;
+      // append every element to out.
+      void append_to(vector<T> &out) const {
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          out.insert(out.end(), elements.chunk(c), elements.chunk(c) + elements.chunk_size(c));
+        }
+      }
+      
+      // write the elements to out as raw bytes, a chunk at a time.
+      void write_to(ostream &out) const {
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          out.write(reinterpret_cast<const char*>(elements.chunk(c)),
+                    elements.chunk_size(c) * sizeof(T));
+        }
+      }
+      
+      // hand the interval over to the tree whose context is to, whose pool must already share
+      // the blocks holding its chunks.
+      void rehome(context *to) { ctx = to; }
+      
+      // call f on every element, a chunk at a time.
+      template<typename F>
+      void for_each(F &f) const {
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          const T *chunk = elements.chunk(c);
+          for (unsigned long i = 0; i < elements.chunk_size(c); ++i) f(chunk[i]);
+        }
+      }
+      
+      // call f on every element for which pred holds.
+      template<typename Pred, typename F>
+      void for_each_if(Pred pred, F &f) const {
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          const T *chunk = elements.chunk(c);
+          for (unsigned long i = 0; i < elements.chunk_size(c); ++i) {
+            if (pred(chunk[i])) f(chunk[i]);
+          }
+        }
       }
       
-      // linearly scan the interval to determine if the key is present.
+      // linearly scan the interval to determine if the key is present, a chunk at a time.
       bool membership(const T &key) {
-        for (vector<T>& vec : elements) {
-          for (T e : vec) {
-            if (key == e) return true;
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          if (simd_contains(elements.chunk(c), elements.chunk_size(c), key, ctx->comp)) {
+            return true;
           }
         }
         return false;
       }
       
-      // Pivot so that keys < p go left, > p go right. Equality is split 50-50.
-      // ideally this could be replaced with in-place pivoting, but since intervals
-      // get moved around and must be able to expand, I don't believe this is possible.
-      pair<shared_ptr<interval>, shared_ptr<interval>> pivot(const T &p) {
-        vector<T> lesser, greater;
-        for (vector<T>& vec : elements) {
-          for (T& e : vec) {
-            if (e < p) {
-              lesser.emplace_back(e);
-            } else if (e > p) {
-              greater.emplace_back(e);
-            } else {
-              if (rand()%2 == 0) {
-                lesser.emplace_back(e);
-              } else {
-                greater.emplace_back(e);
+      // return a pointer to an element equal to key, or nullptr if there is none.
+      T* find(const T &key) {
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          T *chunk = elements.chunk(c);
+          for (unsigned long i = 0; i < elements.chunk_size(c); ++i) {
+            if (ctx->equivalent(key, chunk[i])) return chunk + i;
+          }
+        }
+        return nullptr;
+      }
+      
+      // Pivot so that keys < p stay in this interval and keys > p are moved to the returned
+      // interval. Equality is split 50-50 by alternating sides. Elements are streamed chunk by
+      // chunk into the two sides, and each chunk is returned to the pool as soon as it has been
+      // read, so the output is written into recycled chunks and a pivot never needs more than
+      // two chunks beyond what the interval already holds.
+      unique_ptr<interval> pivot(const T &p) {
+        LST_COUNT(pivots, 1);
+        LST_COUNT(elements_pivoted, size());
+        if (ctx->workers && size() >= ctx->parallel_threshold) return pivot_parallel(p);
+        static const unsigned long buf_size = chunk_list<T>::chunk_capacity +
+                                              (simd_enabled<T, Comp>::value ? simd_slack : 0);
+        unique_ptr<interval> greater(new interval(ctx));
+        chunk_list<T> lesser;
+        bool toggle = false, any_left = false;
+        T left_max = T();
+        T lesser_buf[buf_size], greater_buf[buf_size];
+        elements.drain(ctx->chunks, [&](const T *chunk, unsigned long n) {
+          T chunk_max;
+          unsigned long n_lesser = simd_partition(chunk, n, p, lesser_buf, greater_buf, toggle,
+                                                  chunk_max, ctx->comp);
+          if (n_lesser > 0) {
+            if (!any_left || ctx->before(left_max, chunk_max)) left_max = chunk_max;
+            any_left = true;
+          }
+          lesser.append(ctx->chunks, lesser_buf, n_lesser);
+          greater->elements.append(ctx->chunks, greater_buf, n - n_lesser);
+        });
+        elements = std::move(lesser);
+        if (!greater->empty()) greater->max_e = max_e;
+        if (any_left) max_e = left_max;
+        return greater;
+      }
+      
+      // pivot as above, on the workers of ctx->workers. The chunks are divided into blocks, and
+      // every chunk of a block is partitioned in place, lesser elements first, in parallel. The
+      // greater elements left before the boundary between the two sides and the lesser elements
+      // after it then come in runs of equal total length, which are swapped in parallel, so the
+      // interval is never copied.
+      unique_ptr<interval> pivot_parallel(const T &p) {
+        static const unsigned long buf_size = chunk_list<T>::chunk_capacity +
+                                              (simd_enabled<T, Comp>::value ? simd_slack : 0);
+        struct block {
+          bool any_lesser;
+          T lesser_max;
+        };
+        const unsigned long n_chunks = elements.n_chunks();
+        const unsigned long n_blocks = min(n_chunks, 4ul * (ctx->workers->size() + 1));
+        vector<block> blocks(n_blocks);
+        vector<unsigned long> chunk_lesser(n_chunks);
+        ctx->workers->parallel_for(n_blocks, [&](unsigned long b) {
+          block &out = blocks[b];
+          out.any_lesser = false;
+          // equal elements alternate sides within a block; alternating the starting side
+          // between blocks keeps the overall split even.
+          bool toggle = b % 2;
+          T lesser_buf[buf_size], greater_buf[buf_size];
+          for (unsigned long c = n_chunks * b / n_blocks; c < n_chunks * (b+1) / n_blocks; ++c) {
+            T *chunk = elements.chunk(c);
+            unsigned long n = elements.chunk_size(c);
+            T chunk_max;
+            unsigned long n_lesser = simd_partition(chunk, n, p, lesser_buf, greater_buf, toggle,
+                                                    chunk_max, ctx->comp);
+            if (n_lesser > 0) {
+              if (!out.any_lesser || ctx->before(out.lesser_max, chunk_max)) {
+                out.lesser_max = chunk_max;
               }
+              out.any_lesser = true;
             }
+            copy(lesser_buf, lesser_buf + n_lesser, chunk);
+            copy(greater_buf, greater_buf + (n - n_lesser), chunk + n_lesser);
+            chunk_lesser[c] = n_lesser;
+          }
+        });
+        
+        // the runs of elements on the wrong side of the boundary, each within a chunk.
+        struct run {
+          unsigned long pos, n;
+        };
+        unsigned long boundary = 0;
+        for (unsigned long n_lesser : chunk_lesser) boundary += n_lesser;
+        vector<run> greater_runs, lesser_runs;
+        vector<unsigned long> greater_before(1, 0), lesser_before(1, 0);
+        for (unsigned long c = 0, first = 0; c < n_chunks; first += elements.chunk_size(c++)) {
+          unsigned long split = first + chunk_lesser[c], last = first + elements.chunk_size(c);
+          if (split < boundary) {
+            greater_runs.push_back(run{split, min(last, boundary) - split});
+            greater_before.push_back(greater_before.back() + greater_runs.back().n);
+          } else if (split > boundary) {
+            unsigned long from = max(first, boundary);
+            lesser_runs.push_back(run{from, split - from});
+            lesser_before.push_back(lesser_before.back() + lesser_runs.back().n);
           }
         }
-        return make_pair(shared_ptr<interval>(new interval(lesser)),
-                         shared_ptr<interval>(new interval(greater)));
+        const unsigned long n_misplaced = greater_before.back();
+        ctx->workers->parallel_for(n_blocks, [&](unsigned long b) {
+          unsigned long k = n_misplaced * b / n_blocks, k_end = n_misplaced * (b+1) / n_blocks;
+          if (k == k_end) return;
+          unsigned long g = upper_bound(greater_before.begin(), greater_before.end(), k) -
+                            greater_before.begin() - 1;
+          unsigned long l = upper_bound(lesser_before.begin(), lesser_before.end(), k) -
+                            lesser_before.begin() - 1;
+          while (k < k_end) {
+            unsigned long g_off = k - greater_before[g], l_off = k - lesser_before[l];
+            unsigned long n = min(k_end - k, min(greater_runs[g].n - g_off,
+                                                 lesser_runs[l].n - l_off));
+            T *from = &elements[greater_runs[g].pos + g_off];
+            swap_ranges(from, from + n, &elements[lesser_runs[l].pos + l_off]);
+            k += n;
+            if (k == greater_before[g+1]) ++g;
+            if (k == lesser_before[l+1]) ++l;
+          }
+        });
+        
+        unique_ptr<interval> greater(new interval(ctx));
+        elements.split(ctx->chunks, boundary, greater->elements);
+        if (!greater->empty()) greater->max_e = max_e;
+        bool any_left = false;
+        T left_max = T();
+        for (const block &b : blocks) {
+          if (b.any_lesser && (!any_left || ctx->before(left_max, b.lesser_max))) {
+            left_max = b.lesser_max;
+          }
+          any_left = any_left || b.any_lesser;
+        }
+        if (any_left) max_e = left_max;
+        return greater;
+      }
+      
+      // Pivot around the m sorted, distinct keys in pivots at once, in a single pass. Piece i
+      // receives the keys between pivots[i-1] and pivots[i]; keys equal to a pivot alternate
+      // between the pieces on either side of it. This interval keeps piece 0 and the other m
+      // pieces are returned in order. found[i] is set if pivots[i] is present.
+      vector<unique_ptr<interval>> pivot_multi(const T *pivots, unsigned long m, bool *found) {
+        LST_COUNT(pivots, 1);
+        LST_COUNT(elements_pivoted, size());
+        vector<chunk_list<T>> pieces(m + 1);
+        vector<T> piece_max(m + 1);
+        vector<bool> toggles(m, false);
+        for (unsigned long i = 0; i < m; ++i) found[i] = false;
+        elements.drain(ctx->chunks, [&](const T *chunk, unsigned long n) {
+          for (unsigned long i = 0; i < n; ++i) {
+            const T &e = chunk[i];
+            unsigned long b = std::lower_bound(pivots, pivots + m, e, ctx->comp) - pivots;
+            if (b < m && !ctx->before(e, pivots[b])) {
+              found[b] = true;
+              toggles[b] = !toggles[b];
+              if (!toggles[b]) ++b;
+            }
+            if (pieces[b].empty() || ctx->before(piece_max[b], e)) piece_max[b] = e;
+            pieces[b].push_back(ctx->chunks, e);
+          }
+        });
+        
+        vector<unique_ptr<interval>> result;
+        for (unsigned long b = 1; b <= m; ++b) {
+          result.emplace_back(new interval(ctx));
+          result.back()->max_e = piece_max[b];
+          result.back()->elements = std::move(pieces[b]);
+        }
+        max_e = piece_max[0];
+        elements = std::move(pieces[0]);
+        return result;
+      }
+      
+      // keep the c smallest elements in this interval and move the rest to the returned interval.
+      // Sorts a copy of the elements, so it is meant for small intervals.
+      unique_ptr<interval> split_smallest(unsigned long c) {
+        LST_COUNT(pivots, 1);
+        LST_COUNT(elements_pivoted, size());
+        vector<T> all;
+        all.reserve(size());
+        elements.drain(ctx->chunks, [&all](const T *chunk, unsigned long n) {
+          all.insert(all.end(), chunk, chunk + n);
+        });
+        nth_element(all.begin(), all.begin() + (c - 1), all.end(), ctx->comp);
+        unique_ptr<interval> greater(new interval(ctx));
+        greater->elements.append(ctx->chunks, all.data() + c, all.size() - c);
+        if (!greater->empty()) greater->max_e = max_e;
+        elements.append(ctx->chunks, all.data(), c);
+        max_e = *max_element(all.begin(), all.begin() + c, ctx->comp);
+        return greater;
+      }
+      
+      // return the number of elements equal to key.
+      unsigned long count_equal(const T &key) {
+        unsigned long total = 0;
+        for (unsigned long c = 0; c < elements.n_chunks(); ++c) {
+          const T *chunk = elements.chunk(c);
+          unsigned long n = elements.chunk_size(c);
+          for (unsigned long i = 0; i < n; ++i) {
+            if (ctx->equivalent(key, chunk[i])) ++total;
+          }
+        }
+        return total;
       }
       
       // compare gaps to one another via their maximum element.
       bool operator< (const interval& other) const {
-        return max_e < other.max_e;
+        return ctx->before(max_e, other.max_e);
       }
       
       // return the number of elements in this interval.
       unsigned long size() const {
-        return int_size;
+        return elements.size();
       }
       
       // get max element. Undefined behavior if interval is empty.
@@ -147,23 +553,53 @@ private:
       
       // return if this interval is empty.
       bool empty( ) const { return size() == 0; }
+      
+      // record that a split recursed depth levels before stopping at this interval.
+      void record_split(int depth) {
+#ifdef LST_STATS
+        ctx->counters.splits += depth;
+        ctx->counters.max_split_depth = max(ctx->counters.max_split_depth, (unsigned long)depth);
+#else
+        (void)depth;
+#endif
+      }
     };  // end interval class
     
+    context *ctx;
     unsigned long gap_size;
+    
+    // the last interval left of the crossing point, where (A) gives way to (B). Inserts land
+    // there most often, so it is where the interval search starts. Only a hint: it is set by
+    // rebalance and kept in step by front and pop_front, but not moved as inserts grow intervals.
     int last_left_idx = 0;
     
+    // cached maximum of the gap, kept here so the gap index never has to chase intervals.back().
+    T max_e;
+    
+    // queries that landed in this gap, plus its share of those that landed in the gaps it was
+    // split from.
+    double hits = 0;
+    
+    // give a gap split off this one its share of the hits, in proportion to its size.
+    void share_hits(gap &piece) const {
+      if (gap_size > 0) piece.hits = hits * piece.size() / gap_size;
+    }
+    
     // the sorted set of intervals within this gap; all elements in intervals[i] <= intervals[i+1].
-    vector<shared_ptr<interval>> intervals;
+    vector<unique_ptr<interval>> intervals;
     
-    // initialize a gap with a vector of intervals.
-    gap(vector<shared_ptr<interval>> &intervals) {
+    // initialize a gap with a vector of intervals, taking them over.
+    gap(context *ctx, vector<unique_ptr<interval>> &intervals) : ctx(ctx) {
       gap_size = 0;
-      for (shared_ptr<interval> g_int : intervals) {
+      for (unique_ptr<interval> &g_int : intervals) {
         if (!g_int->empty()) {
-          this->intervals.emplace_back(g_int);
           gap_size += g_int->size();
+          this->intervals.emplace_back(std::move(g_int));
         }
       }
+      if (!this->intervals.empty()) {
+        max_e = this->intervals.back()->get_max();
+      }
       rebalance();
     }
     
@@ -172,7 +608,7 @@ private:
     // Optimized to provide O(1) average case insert, O(log log Delta_i) worst-case.
     int getIntervalIdx(const T &key) {
       int lo = last_left_idx, hi, mult;
-      bool init = key <= intervals[last_left_idx]->get_max();
+      bool init = !ctx->before(intervals[last_left_idx]->get_max(), key);
       if (init) {
         mult = -1;
       } else {
@@ -190,7 +626,7 @@ private:
           hi = (int)intervals.size();
           break;
         }
-        if (init != (key <= intervals[hi]->get_max())) {
+        if (init != !ctx->before(intervals[hi]->get_max(), key)) {
           break;
         }
       }
@@ -203,7 +639,7 @@ private:
         }
         
         int mid = (lo+hi)/2;
-        if (init == (key <= intervals[mid]->get_max())) {
+        if (init == !ctx->before(intervals[mid]->get_max(), key)) {
           lo = mid;
         } else {
           hi = mid;
@@ -231,131 +667,486 @@ private:
       return total;
     }*/
     
-    // pick the pivot element to split the interval. Currently unused.
-  /*  T pick_pivot(int sample_size, shared_ptr<interval> g_int) {
-      vector<T> pivots(sample_size);
-      for (int i = 0; i < sample_size; ++i)
-        pivots[i] = g_int->sample();
-      sort(pivots.begin(), pivots.end());
-      return pivots[sample_size/2];
-    }*/
-    
     // split interval g_int, recursing on either the left or right side of the split,
-    // based on the value of "recurse_left". Return a vector of all resulting intervals.
-    vector<shared_ptr<interval>> split(shared_ptr<interval> g_int, bool recurse_left, int n_recursions) {
+    // based on the value of "recurse_left". Return a vector of all resulting intervals. depth is
+    // the number of levels above this one, for stats.
+    vector<unique_ptr<interval>> split(unique_ptr<interval> g_int, bool recurse_left,
+                                       int n_recursions,
+                                       int depth = 0) {
       // Base case.
       if (n_recursions == 0 || g_int->size() <= 1) {
-        vector<shared_ptr<interval>> temp;
-        temp.emplace_back(g_int); // may be emplacing an empty interval. That is okay.
+        g_int->record_split(depth);
+        vector<unique_ptr<interval>> temp;
+        temp.emplace_back(std::move(g_int)); // may be emplacing an empty interval. That is okay.
         return temp;
       }
       
-      T p = g_int->sample();
-      auto result_split = g_int->pivot(p);
-      shared_ptr<interval> lesser = result_split.first;
-      shared_ptr<interval> greater = result_split.second;
+      T p = g_int->choose_pivot();
+      unique_ptr<interval> greater = g_int->pivot(p);
       
       // Recurse.
-      vector<shared_ptr<interval>> result;
+      vector<unique_ptr<interval>> result;
       if (recurse_left) {
-        result = split(lesser, true, n_recursions-1);
-        result.emplace_back(greater);
+        result = split(std::move(g_int), true, n_recursions-1, depth+1);
+        result.emplace_back(std::move(greater));
       } else {
-        result.emplace_back(lesser);
-        vector<shared_ptr<interval>> temp = split(greater, false, n_recursions-1);
-        result.insert(result.end(), temp.begin(), temp.end());
+        result.emplace_back(std::move(g_int));
+        vector<unique_ptr<interval>> temp = split(std::move(greater), false, n_recursions-1, depth+1);
+        result.insert(result.end(), make_move_iterator(temp.begin()), make_move_iterator(temp.end()));
       }
       return result;
     }
     
   public:
     // create a gap with a single interval containing a single element.
-    gap(const T &key) {
+    gap(context *ctx, const T &key) : ctx(ctx) {
       gap_size = 1;
-      intervals.emplace_back(new interval(key));
+      intervals.emplace_back(new interval(ctx, key));
+      max_e = key;
+    }
+    
+    // create a gap with a single interval that takes over the storage of a non-empty vector.
+    gap(context *ctx, vector<T> &&keys) : ctx(ctx) {
+      gap_size = keys.size();
+      intervals.emplace_back(new interval(ctx, std::move(keys)));
+      max_e = intervals.back()->get_max();
     }
     
-    // compare gaps to one another via their maximum element.
-    bool operator< (const gap& other) const {
-      return *(intervals.back()) < *(other.intervals.back());
+    // create a gap over n_intervals intervals of a snapshot, as written by describe: interval i
+    // holds elements [bounds[i], bounds[i+1]) of elements and has maximum maxima[i].
+    gap(context *ctx, T *elements, const uint64_t *bounds, const T *maxima,
+        unsigned long n_intervals, double hits) : ctx(ctx), hits(hits) {
+      gap_size = bounds[n_intervals] - bounds[0];
+      intervals.reserve(n_intervals);
+      for (unsigned long i = 0; i < n_intervals; ++i) {
+        intervals.emplace_back(new interval(ctx, elements + bounds[i], bounds[i+1] - bounds[i],
+                                            maxima[i]));
+      }
+      max_e = maxima[n_intervals - 1];
+      rebalance();
     }
     
     // insert key into this gap.
     void insert(const T &key) {
       intervals[getIntervalIdx(key)]->insert(key);
+      max_e = ctx->larger(max_e, key);
       ++gap_size;
     }
     
+    // insert the keys in [first, last), all of which belong to this gap.
+    void insert_bulk(const T *first, const T *last) {
+      for (const T *key = first; key != last; ++key) {
+        intervals[getIntervalIdx(*key)]->insert(*key);
+        max_e = ctx->larger(max_e, *key);
+      }
+      gap_size += last - first;
+    }
+    
+    // remove the elements e with lo <= e < hi, or lo <= e <= hi if include_hi, and return how many
+    // were removed, appending them to out unless it is null. If at_least_lo, every element of the
+    // gap is known to be >= lo. Intervals that lie entirely in the range are dropped whole, the
+    // others are filtered in place, and the intervals are rebalanced afterwards so that none is
+    // left undersized.
+    unsigned long erase_range(const T &lo, const T &hi, bool include_hi, bool at_least_lo,
+                              vector<T> *out) {
+      auto below_hi = [this, &hi, include_hi](const T &e) {
+        return include_hi ? !ctx->before(hi, e) : ctx->before(e, hi);
+      };
+      int int_idx = at_least_lo ? 0 : getIntervalIdx(lo);
+      vector<unique_ptr<interval>> kept(make_move_iterator(intervals.begin()),
+                                        make_move_iterator(intervals.begin() + int_idx));
+      unsigned long removed = 0;
+      bool in_range = true;
+      for (int i = int_idx; i < (int)intervals.size(); ++i) {
+        if (!in_range) {
+          kept.emplace_back(std::move(intervals[i]));
+          continue;
+        }
+        T int_max = intervals[i]->get_max();
+        if (at_least_lo && below_hi(int_max)) {
+          removed += intervals[i]->size();
+          if (out) intervals[i]->append_to(*out);
+          continue;
+        }
+        removed += intervals[i]->erase_if([this, &lo, &below_hi](const T &e) {
+          return !ctx->before(e, lo) && below_hi(e);
+        }, out);
+        if (!intervals[i]->empty()) kept.emplace_back(std::move(intervals[i]));
+        // every later element is >= int_max, which is >= lo.
+        in_range = below_hi(int_max);
+        at_least_lo = true;
+      }
+      
+      intervals.swap(kept);
+      gap_size -= removed;
+      if (removed > 0 && !intervals.empty()) {
+        max_e = intervals.back()->get_max();
+        rebalance();
+      }
+      return removed;
+    }
+    
+    // append the end of each interval to bounds, counting on from bounds.back(), and its maximum
+    // to maxima, for a snapshot.
+    void describe(vector<uint64_t> &bounds, vector<T> &maxima) const {
+      for (const unique_ptr<interval> &g_int : intervals) {
+        bounds.push_back(bounds.back() + g_int->size());
+        maxima.push_back(g_int->get_max());
+      }
+    }
+    
+    // write the elements of every interval to out, in order, for a snapshot.
+    void write_elements(ostream &out) const {
+      for (const unique_ptr<interval> &g_int : intervals) g_int->write_to(out);
+    }
+    
+    // hand the intervals over to the tree whose context is to, as interval::rehome does.
+    void rehome(context *to) {
+      ctx = to;
+      for (unique_ptr<interval> &g_int : intervals) g_int->rehome(to);
+    }
+    
+    // append every element of the gap to out.
+    void append_to(vector<T> &out) const {
+      for (const unique_ptr<interval> &g_int : intervals) g_int->append_to(out);
+    }
+    
+    // call f on every element of the gap.
+    template<typename F>
+    void for_each(F &f) const {
+      for (const unique_ptr<interval> &g_int : intervals) g_int->for_each(f);
+    }
+    
+    // call f on every element e with lo <= e < hi. If at_least_lo, every element of the gap is
+    // known to be >= lo. As in erase_range, intervals that lie entirely in the range are streamed
+    // whole and only the others are compared against the bounds.
+    template<typename F>
+    void for_each_between(const T &lo, const T &hi, bool at_least_lo, F &f) {
+      int int_idx = at_least_lo ? 0 : getIntervalIdx(lo);
+      for (int i = int_idx; i < (int)intervals.size(); ++i) {
+        T int_max = intervals[i]->get_max();
+        bool below_hi = ctx->before(int_max, hi);
+        if (at_least_lo && below_hi) {
+          intervals[i]->for_each(f);
+        } else {
+          intervals[i]->for_each_if([this, &lo, &hi](const T &e) {
+            return !ctx->before(e, lo) && ctx->before(e, hi);
+          }, f);
+        }
+        // every later element is >= int_max, which is >= lo.
+        if (!below_hi) return;
+        at_least_lo = true;
+      }
+    }
+    
+    // move the intervals of greater, all of whose elements are >= those of this gap, to the end of
+    // this gap, leaving greater empty.
+    void merge(gap &greater) {
+      intervals.insert(intervals.end(), make_move_iterator(greater.intervals.begin()),
+                       make_move_iterator(greater.intervals.end()));
+      greater.intervals.clear();
+      gap_size += greater.gap_size;
+      greater.gap_size = 0;
+      hits += greater.hits;
+      greater.hits = 0;
+      max_e = greater.max_e;
+      rebalance();
+    }
+    
     // query for membership of key in this gap. Note: this only answers the query. Restructuring
     // is done in the restructure method.
     bool membership(const T &key) {
       return intervals[getIntervalIdx(key)]->membership(key);
     }
     
-    // restructure the gap so that all elements in gap > key remain in the gap and a new gap
-    // is created and returned with elements <= key. TODO: replace with more general function.
+    // return a pointer to an element equal to key, or nullptr if there is none. Only the interval
+    // key falls in is scanned.
+    T* find(const T &key) {
+      return intervals[getIntervalIdx(key)]->find(key);
+    }
+    
+    // split the gap into the elements <= key and those > key, which are returned as two new
+    // gaps. The intervals are moved into the new gaps, so this gap is left without any and must
+    // be erased. The restructures below do the same.
     pair<gap, gap> restructure(const T &key, int n_recursions) {
       int int_idx = getIntervalIdx(key);
-      auto result = intervals[int_idx]->pivot(key);
+      unique_ptr<interval> greater_int = intervals[int_idx]->pivot(key);
       
-      vector<shared_ptr<interval>> left_result = split(result.first, false, n_recursions);
-      vector<shared_ptr<interval>> greater = split(result.second, true, n_recursions);
-      vector<shared_ptr<interval>> lesser;
+      vector<unique_ptr<interval>> left_result = split(std::move(intervals[int_idx]), false,
+                                                       n_recursions);
+      vector<unique_ptr<interval>> greater = split(std::move(greater_int), true, n_recursions);
+      vector<unique_ptr<interval>> lesser;
+      lesser.reserve(int_idx + left_result.size());
       for (int i = 0; i < int_idx; ++i) {
-        lesser.emplace_back(intervals[i]);
+        lesser.emplace_back(std::move(intervals[i]));
       }
-      lesser.insert(lesser.end(), left_result.begin(), left_result.end());
-      for (int i = int_idx+1; i < intervals.size(); ++i) {
-        greater.emplace_back(intervals[i]);
+      lesser.insert(lesser.end(), make_move_iterator(left_result.begin()),
+                    make_move_iterator(left_result.end()));
+      for (int i = int_idx+1; i < (int)intervals.size(); ++i) {
+        greater.emplace_back(std::move(intervals[i]));
       }
+      intervals.clear();
       
       // for many reasons, the intervals of lesser or greater may be empty.
       // The gap constructor will keep only non-empty intervals.
-      return make_pair(gap(lesser), gap(greater));
+      pair<gap, gap> result = make_pair(gap(ctx, lesser), gap(ctx, greater));
+      share_hits(result.first);
+      share_hits(result.second);
+      return result;
+    }
+    
+    // return if the gap is a single interval of at most limit elements.
+    bool small_enough(unsigned long limit) const {
+      return intervals.size() == 1 && gap_size <= limit;
     }
     
-    template <typename Iterator, typename f>
-    int perform_merges(Iterator begin,
-                        Iterator end,
-                        f deletion) {
-      int n_out = 0;
-      int i = 0;
-      auto it = begin;
+    // narrow the first interval down to at most limit elements, as front does, and return it as
+    // the first gap and the other intervals as the second, which may be empty. As with
+    // restructure, this gap is left without intervals.
+    pair<gap, gap> split_front(unsigned long limit) {
+      narrow_front(limit);
+      vector<unique_ptr<interval>> first, rest(make_move_iterator(intervals.begin() + 1),
+                                               make_move_iterator(intervals.end()));
+      first.emplace_back(std::move(intervals[0]));
+      intervals.clear();
+      pair<gap, gap> result = make_pair(gap(ctx, first), gap(ctx, rest));
+      share_hits(result.first);
+      share_hits(result.second);
+      return result;
+    }
+    
+    // restructure the gap so that the k+1 smallest elements of the gap are in the first returned
+    // gap and the rest in the second. The interval holding rank k is narrowed down by repeated
+    // pivoting around sampled elements, as in quickselect, and every piece cut off along the way
+    // is kept as its own interval, so the work also refines the gap.
+    pair<gap, gap> restructure_rank(unsigned long k) {
+      int int_idx = 0;
+      while (k >= intervals[int_idx]->size()) {
+        k -= intervals[int_idx]->size();
+        ++int_idx;
+      }
+      
+      vector<unique_ptr<interval>> lesser(make_move_iterator(intervals.begin()),
+                                          make_move_iterator(intervals.begin() + int_idx));
+      vector<unique_ptr<interval>> right_pieces;  // in reverse order
+      unique_ptr<interval> cur = std::move(intervals[int_idx]);
       for (;;) {
-        auto it2 = it;
-        ++it2;
-        if (it2 == end) break;
-        int cur_size = (int)(*it)->size();
-        int next_size = (int)(*it2)->size();
-        int n_in = (int)size() - cur_size - n_out;
-        if (n_out + cur_size >= n_in - next_size) {  // it2 is on the other side
-          return i;
+        if (cur->size() <= 32) {
+          right_pieces.emplace_back(cur->split_smallest(k + 1));
+          lesser.emplace_back(std::move(cur));
+          break;
         }
-        
-        if (n_out >= cur_size + next_size) {
-          (*it)->merge(*it2);
-          deletion(it2);
+        unique_ptr<interval> greater_int = cur->pivot(cur->choose_pivot());
+        if (k < cur->size()) {
+          right_pieces.emplace_back(std::move(greater_int));
         } else {
-          n_out += cur_size;
-          ++it;
-          ++i;
+          k -= cur->size();
+          lesser.emplace_back(std::move(cur));
+          cur = std::move(greater_int);
+        }
+      }
+      
+      vector<unique_ptr<interval>> greater(make_move_iterator(right_pieces.rbegin()),
+                                           make_move_iterator(right_pieces.rend()));
+      greater.insert(greater.end(), make_move_iterator(intervals.begin() + int_idx + 1),
+                     make_move_iterator(intervals.end()));
+      intervals.clear();
+      pair<gap, gap> result = make_pair(gap(ctx, lesser), gap(ctx, greater));
+      share_hits(result.first);
+      share_hits(result.second);
+      return result;
+    }
+    
+    // narrow the first interval down to the limit smallest elements of the gap. The first
+    // interval is pivoted around random samples, keeping the lesser side in front, so the pieces
+    // cut off grow geometrically towards the right, which is the shape that lets the next calls
+    // again find the smallest elements in a small interval.
+    void narrow_front(unsigned long limit) {
+      while (intervals[0]->size() > limit) {
+        unique_ptr<interval> greater_int;
+        if (intervals[0]->size() <= 32) {
+          greater_int = intervals[0]->split_smallest(limit);
+        } else {
+          greater_int = intervals[0]->pivot(intervals[0]->choose_pivot());
+          if (intervals[0]->empty()) {
+            intervals[0] = std::move(greater_int);
+            continue;
+          }
         }
+        if (!greater_int->empty()) {
+          intervals.insert(intervals.begin() + 1, std::move(greater_int));
+          ++last_left_idx;
+        }
+      }
+    }
+    
+    // narrow the first interval down to the single smallest element of the gap and return it.
+    T front() {
+      narrow_front(1);
+      return intervals[0]->get_max();
+    }
+    
+    // return if every element of the gap comes after key, scanning them all. Meant for assertions.
+    bool all_after(const T &key) const {
+      bool after = true;
+      auto check = [this, &key, &after](const T &e) { after = after && ctx->before(key, e); };
+      for_each(check);
+      return after;
+    }
+    
+    // remove the smallest element of the gap. Undefined behavior if the gap is empty.
+    void pop_front() {
+      front();
+      intervals.erase(intervals.begin());
+      if (last_left_idx > 0) --last_left_idx;
+      --gap_size;
+    }
+    
+    // return the number of elements equal to key, given that no element of the gap exceeds key.
+    // Only the trailing intervals with maximum key can hold such elements.
+    unsigned long count_trailing(const T &key) {
+      unsigned long total = 0;
+      for (int i = (int)intervals.size() - 1; i >= 0 && !ctx->before(intervals[i]->get_max(), key); --i) {
+        total += intervals[i]->count_equal(key);
+      }
+      return total;
+    }
+    
+    // return the size of the interval a query for key lands in.
+    unsigned long interval_size(const T &key) {
+      return intervals[getIntervalIdx(key)]->size();
+    }
+    
+    // record that n queries landed in this gap, returning the hits so far.
+    double add_hits(unsigned long n) {
+      return hits += n;
+    }
+    
+    double get_hits() const { return hits; }
+    
+    // return the size of the largest interval, which bounds the cost of a query landing here.
+    unsigned long largest_interval() const {
+      unsigned long largest = 0;
+      for (const unique_ptr<interval> &g_int : intervals) largest = max(largest, g_int->size());
+      return largest;
+    }
+    
+    // add the number and sizes of this gap's intervals to s.
+    void add_shape(lst_stats &s) const {
+      s.n_intervals += intervals.size();
+      for (const unique_ptr<interval> &g_int : intervals) {
+        unsigned long bucket = 0;
+        for (unsigned long n = g_int->size(); n > 1; n >>= 1) ++bucket;
+        if (s.interval_sizes.size() <= bucket) s.interval_sizes.resize(bucket + 1);
+        ++s.interval_sizes[bucket];
+        s.largest_interval = max(s.largest_interval, g_int->size());
+      }
+    }
+    
+    // restructure the gap as a query would, around an element sampled from its largest interval.
+    pair<gap, gap> restructure_largest(int n_recursions) {
+      int largest_idx = 0;
+      for (int i = 1; i < (int)intervals.size(); ++i) {
+        if (intervals[i]->size() > intervals[largest_idx]->size()) largest_idx = i;
+      }
+      return restructure(intervals[largest_idx]->choose_pivot(), n_recursions);
+    }
+    
+    // restructure the gap around all m sorted, distinct keys in pivots at once, returning the m+1
+    // gaps between them in order; any may be empty. Each interval holding pivots is partitioned
+    // in a single pass, and the pieces next to each pivot are split further as in the single-key
+    // restructure. found[i] is set if pivots[i] is present.
+    vector<gap> restructure(const T *pivots, unsigned long m, bool *found, int n_recursions) {
+      vector<vector<unique_ptr<interval>>> groups(1);
+      unsigned long next = 0;
+      for (int int_idx = 0; int_idx < (int)intervals.size(); ++int_idx) {
+        // pivots belonging to this interval; pivots past the maximum belong to the last.
+        unsigned long first = next;
+        while (next < m && (int_idx + 1 == (int)intervals.size() ||
+                            !ctx->before(intervals[int_idx]->get_max(), pivots[next]))) {
+          ++next;
+        }
+        if (first == next) {
+          groups.back().emplace_back(std::move(intervals[int_idx]));
+          continue;
+        }
+        
+        vector<unique_ptr<interval>> pieces = intervals[int_idx]->pivot_multi(pivots + first,
+                                                                            next - first,
+                                                                            found + first);
+        vector<unique_ptr<interval>> left = split(std::move(intervals[int_idx]), false,
+                                                  n_recursions);
+        groups.back().insert(groups.back().end(), make_move_iterator(left.begin()),
+                             make_move_iterator(left.end()));
+        for (unsigned long i = 0; i + 1 < pieces.size(); ++i) {
+          // a piece bounded by pivots on both sides is refined at both ends.
+          vector<unique_ptr<interval>> middle = split(std::move(pieces[i]), true, n_recursions);
+          unique_ptr<interval> rest = std::move(middle.back());
+          middle.pop_back();
+          vector<unique_ptr<interval>> right = split(std::move(rest), false, n_recursions);
+          middle.insert(middle.end(), make_move_iterator(right.begin()),
+                        make_move_iterator(right.end()));
+          groups.emplace_back(std::move(middle));
+        }
+        groups.emplace_back(split(std::move(pieces.back()), true, n_recursions));
+      }
+      intervals.clear();
+      
+      vector<gap> result;
+      result.reserve(groups.size());
+      for (vector<unique_ptr<interval>> &group : groups) {
+        result.emplace_back(gap(ctx, group));
+        share_hits(result.back());
       }
-      return i;
+      return result;
     }
     
-    // rebalance according to (A) and (B). Precondition: no interval is empty.
+    // rebalance according to (A) and (B), in place. Intervals are merged from the front towards
+    // the crossing point: an interval is merged into its left neighbor while the elements before
+    // that neighbor outnumber the two of them together. Then the same from the back. Each pass
+    // stops at the crossing point and closes the slots of merged intervals with a single shift.
+    // The passes don't stop at the intervals next to a split: inserts grow intervals without
+    // rebalancing, which can make any neighboring pair mergeable, and (A) and (B) keep a gap at
+    // O(log size) intervals, so scanning to the crossing point is cheap.
+    // Precondition: no interval is empty.
     void rebalance() {
-      list<shared_ptr<interval>> intervals_list(intervals.begin(), intervals.end());
-      last_left_idx = perform_merges(intervals_list.begin(), intervals_list.end(),
-                     [&intervals_list](typename list<shared_ptr<interval>>::iterator it){
-        intervals_list.erase(it);
-      });
-      perform_merges(intervals_list.rbegin(), intervals_list.rend(),
-                   [&intervals_list](typename list<shared_ptr<interval>>::reverse_iterator it){
-        intervals_list.erase(next(it).base());
-      });
-      intervals = vector<shared_ptr<interval>>(intervals_list.begin(), intervals_list.end());
+      int n = (int)intervals.size();
+      unsigned long n_out = 0;
+      int w = 0, r = 1;
+      for (; r < n; ++r) {
+        unsigned long cur_size = intervals[w]->size(), next_size = intervals[r]->size();
+        if (2 * (n_out + cur_size) + next_size >= gap_size) break;  // r is on the other side
+        if (n_out >= cur_size + next_size) {
+          intervals[w]->merge(*intervals[r]);
+        } else {
+          n_out += cur_size;
+          intervals[++w] = std::move(intervals[r]);
+        }
+      }
+      intervals.erase(intervals.begin() + min(w + 1, n), intervals.begin() + min(r, n));
+      last_left_idx = w;
+      
+      n = (int)intervals.size();
+      n_out = 0;
+      w = n - 1;
+      r = n - 2;
+      for (; r >= 0; --r) {
+        unsigned long cur_size = intervals[w]->size(), next_size = intervals[r]->size();
+        if (2 * (n_out + cur_size) + next_size >= gap_size) break;  // r is on the other side
+        if (n_out >= cur_size + next_size) {
+          intervals[w]->merge(*intervals[r]);
+        } else {
+          n_out += cur_size;
+          intervals[--w] = std::move(intervals[r]);
+        }
+      }
+      if (r + 1 < w) {
+        intervals.erase(intervals.begin() + (r + 1), intervals.begin() + w);
+        // the merges from the back reached the crossing point found from the front, whose
+        // interval is now the first one they left.
+        if (last_left_idx > r) last_left_idx = r + 1;
+      }
+      if (last_left_idx >= (int)intervals.size()) last_left_idx = 0;
     }
     
     // return the number of elements in this gap.
@@ -366,8 +1157,9 @@ private:
     // return if this gap is empty.
     bool empty( ) const { return size() == 0; }
     
-    T get_max() {
-      return intervals.back()->get_max();
+    // get max element. Undefined behavior if gap is empty.
+    const T& get_max() const {
+      return max_e;
     }
     
     void print() {
@@ -375,23 +1167,406 @@ private:
     }
   };  // end gap class
   
-  splay_tree<gap> gap_ds;
+  // orders gaps by their maximum element, through a copy of the tree's comparator. The mixed
+  // overloads let the gap index be searched with a bare key, so insert and count don't construct
+  // a temporary gap per call, and key lets an index keep the maxima apart from the gaps.
+  struct gap_compare {
+    Comp comp;
+    explicit gap_compare(const Comp &comp = Comp()) : comp(comp) {}
+    static const T& key(const gap &g) { return g.get_max(); }
+    bool operator()(const gap &a, const gap &b) const { return comp(a.get_max(), b.get_max()); }
+    bool operator()(const gap &a, const T &b) const { return comp(a.get_max(), b); }
+    bool operator()(const T &a, const gap &b) const { return comp(a, b.get_max()); }
+    bool operator()(const T &a, const T &b) const { return comp(a, b); }
+  };
+  
+  // weighs each gap by its number of elements, so the gap index can answer rank queries.
+  struct gap_weight {
+    unsigned long operator()(const gap &g) const { return g.size(); }
+  };
+  
+  typedef GapIndex<gap, gap_compare, pool_allocator<gap>, gap_weight> gap_tree;
+  typedef typename gap_tree::iterator gap_iterator;
+  
+  // declared before gap_ds so that it outlives the intervals drawing chunks from it.
+  unique_ptr<context> ctx;
+  gap_tree gap_ds;
+  // the pool created by use_threads, if any.
+  unique_ptr<thread_pool> own_workers;
+  
+  // a gap that erasing leaves with fewer elements than this is merged into a neighbor, so that the
+  // number of gaps follows the queries whose elements are still live rather than all past ones.
+  static const unsigned long min_gap_size = 16;
+  
+  // the gap holding the smallest elements, so top() and pop() never search the gap index. It is
+  // end() when unknown, which is whenever a restructure may have replaced the first gap.
+  gap_iterator min_gap;
+  
+  // record a query for key landing in r_gap and return the depth to restructure it to.
+  int query_depth(gap &r_gap, const T &key) {
+    return restructure_policy.depth(1, r_gap.add_hits(1), r_gap.size(), r_gap.interval_size(key));
+  }
+  
+  // return the depth to restructure r_gap to when refine splits its largest interval, of
+  // interval_size elements: the depth a query landing there would get, without recording one.
+  int refine_depth(gap &r_gap, unsigned long interval_size) {
+    return restructure_policy.depth(0, r_gap.get_hits(), r_gap.size(), interval_size);
+  }
+  
+  // restructure r_gap around key for a query, replacing it in the gap index by the two gaps it
+  // splits into.
+  void split_gap(gap &r_gap, const T &key) {
+    pair<gap, gap> new_gaps = r_gap.restructure(key, query_depth(r_gap, key));
+    gap_ds.erase(r_gap);  // note: this destroys r_gap.
+    min_gap = gap_ds.end();
+    if (!new_gaps.first.empty()) {
+      gap_ds.insert(std::move(new_gaps.first));
+    }
+    if (!new_gaps.second.empty()) {
+      gap_ds.insert(std::move(new_gaps.second));
+    }
+  }
+  
+  // refine leaves intervals of this size or smaller alone, as scanning one is a single pass over
+  // a chunk.
+  static const unsigned long refine_min_interval = chunk_list<T>::chunk_capacity;
+  
+  // split the gaps with the largest intervals as queries would, largest first, while
+  // keep_going(work) holds for the work done so far, and return that work. Work is counted as the
+  // elements of the intervals split.
+  template<typename Continue>
+  unsigned long refine_while(Continue keep_going) {
+    // gaps are identified by their maximum, since splitting a gap replaces it in the gap index.
+    typedef pair<unsigned long, T> entry;
+    auto smaller = [](const entry &a, const entry &b) { return a.first < b.first; };
+    priority_queue<entry, vector<entry>, decltype(smaller)> largest(smaller);
+    for (gap_iterator it = gap_ds.begin(); it != gap_ds.end(); ++it) {
+      unsigned long largest_int = it->largest_interval();
+      if (largest_int > refine_min_interval) largest.emplace(largest_int, it->get_max());
+    }
+    
+    unsigned long work = 0;
+    while (!largest.empty() && keep_going(work)) {
+      gap &r_gap = gap_ds.lower_bound_or_last(largest.top().second);
+      unsigned long split_size = largest.top().first;
+      work += split_size;
+      largest.pop();
+      pair<gap, gap> new_gaps = r_gap.restructure_largest(refine_depth(r_gap, split_size));
+      gap_ds.erase(r_gap);  // note: this destroys r_gap.
+      min_gap = gap_ds.end();
+      for (gap *g : {&new_gaps.first, &new_gaps.second}) {
+        if (g->empty()) continue;
+        unsigned long largest_int = g->largest_interval();
+        if (largest_int > refine_min_interval) largest.emplace(largest_int, g->get_max());
+        gap_ds.insert(std::move(*g));
+      }
+    }
+    return work;
+  }
+  
+  // sorted iteration leaves gaps of at most this many elements behind it, each a single interval
+  // that is read a chunk at a time, as refine does.
+  static const unsigned long sorted_piece = chunk_list<T>::chunk_capacity;
+  
+  // make the gap at it small enough for sorted iteration to copy and sort, by splitting off its
+  // smallest elements as in split_front. Returns the gap holding them.
+  gap_iterator split_for_iteration(gap_iterator it) {
+    if (it->small_enough(sorted_piece)) return it;
+    pair<gap, gap> new_gaps = it->split_front(sorted_piece);
+    T first_max = new_gaps.first.get_max();
+    gap_ds.erase(it);  // note: this destroys the gap.
+    min_gap = gap_ds.end();
+    gap_ds.insert(std::move(new_gaps.first));
+    if (!new_gaps.second.empty()) gap_ds.insert(std::move(new_gaps.second));
+    return gap_ds.locate(first_max);
+  }
+  
+  // restructure the gap holding key around it as count() would, moving the elements equal to key
+  // up into the gap above, so that the elements not before key start a gap. Returns that gap, or
+  // end() if every element is before key.
+  gap_iterator gap_starting_at(const T &key) {
+    if (empty()) return gap_ds.end();
+    gap_iterator it = gap_ds.locate(key);
+    if (ctx->before(it->get_max(), key)) return gap_ds.end();
+    
+    pair<gap, gap> new_gaps = it->restructure(key, query_depth(*it, key));
+    gap_ds.erase(it);  // note: this destroys the gap.
+    min_gap = gap_ds.end();
+    // elements equal to key may have been restructured to either side.
+    vector<T> equal;
+    if (!new_gaps.first.empty() && !ctx->before(new_gaps.first.get_max(), key)) {
+      new_gaps.first.erase_range(key, key, true, false, &equal);
+    }
+    if (!equal.empty()) {
+      gap equal_gap(ctx.get(), std::move(equal));
+      if (!new_gaps.second.empty()) equal_gap.merge(new_gaps.second);
+      new_gaps.second = std::move(equal_gap);
+    }
+    if (!new_gaps.first.empty()) gap_ds.insert(std::move(new_gaps.first));
+    if (!new_gaps.second.empty()) gap_ds.insert(std::move(new_gaps.second));
+    return gap_ds.locate(key);
+  }
+  
+  // find the first gap if it isn't cached. Undefined behavior if the tree is empty.
+  gap_iterator first_gap() {
+    if (min_gap == gap_ds.end()) min_gap = gap_ds.begin();
+    return min_gap;
+  }
+  
+  // merge the gap at it into its successor, or into its predecessor if it's the last gap, if
+  // erasing has left it undersized. The lesser gap of the pair absorbs the greater one, whose
+  // node is erased; either way the order of the gap index is kept.
+  void merge_if_undersized(gap_iterator it) {
+    if (it->size() >= min_gap_size) return;
+    gap_iterator next = it;
+    ++next;
+    if (next == gap_ds.end()) {
+      if (it == gap_ds.begin()) return;
+      next = it;
+      --it;
+    }
+    LST_COUNT(gap_merges, 1);
+    it->merge(*next);
+    gap_ds.erase(next);
+    gap_ds.refresh(it);
+  }
+  
+  // remove the elements e with lo <= e < hi, or lo <= e <= hi if include_hi, appending them to out
+  // unless it is null. Gaps between the first and last that hold elements of the range lie
+  // entirely inside it and are dropped without being scanned; the two end gaps are filtered and
+  // merged into a neighbor if left undersized.
+  unsigned long erase_between(const T &lo, const T &hi, bool include_hi, vector<T> *out) {
+    if (empty()) return 0;
+    gap_iterator it = gap_ds.locate(lo);
+    if (ctx->before(it->get_max(), lo)) return 0;
+    min_gap = gap_ds.end();
+    
+    unsigned long removed = 0;
+    bool at_least_lo = false;
+    gap_iterator first_kept = gap_ds.end(), last_kept = gap_ds.end();
+    while (it != gap_ds.end()) {
+      gap_iterator next = it;
+      ++next;
+      T gap_max = it->get_max();
+      bool below_hi = include_hi ? !ctx->before(hi, gap_max) : ctx->before(gap_max, hi);
+      if (at_least_lo && below_hi) {
+        removed += it->size();
+        if (out) it->append_to(*out);
+        gap_ds.erase(it);
+      } else {
+        removed += it->erase_range(lo, hi, include_hi, at_least_lo, out);
+        if (it->empty()) {
+          gap_ds.erase(it);
+        } else {
+          gap_ds.refresh(it);
+          if (first_kept == gap_ds.end()) first_kept = it;
+          last_kept = it;
+        }
+      }
+      // every element of later gaps is >= gap_max, which is >= lo.
+      if (!below_hi) break;
+      at_least_lo = true;
+      it = next;
+    }
+    
+    // the last gap first, since merging the first gap may erase it.
+    if (last_kept != gap_ds.end() && last_kept != first_kept) merge_if_undersized(last_kept);
+    if (first_kept != gap_ds.end()) merge_if_undersized(first_kept);
+    lst_size -= removed;
+    return removed;
+  }
+  
+  // byte offsets of the sections of a snapshot, see lst_snapshot_header. end is the file size.
+  struct snapshot_layout {
+    uint64_t gap_bounds, gap_hits, interval_bounds, interval_maxima, elements, end;
+  };
+  
+  static constexpr char snapshot_magic[8] = {'L', 'S', 'T', 'S', 'N', 'A', 'P', '1'};
+  static const uint64_t snapshot_align = 64;
+  
+  static uint64_t align_up(uint64_t offset) {
+    return (offset + snapshot_align - 1) / snapshot_align * snapshot_align;
+  }
+  
+  static snapshot_layout layout_of(const lst_snapshot_header &h) {
+    snapshot_layout l;
+    l.gap_bounds = align_up(sizeof(lst_snapshot_header));
+    l.gap_hits = align_up(l.gap_bounds + (h.n_gaps + 1) * sizeof(uint64_t));
+    l.interval_bounds = align_up(l.gap_hits + h.n_gaps * sizeof(double));
+    l.interval_maxima = align_up(l.interval_bounds + (h.n_intervals + 1) * sizeof(uint64_t));
+    l.elements = align_up(l.interval_maxima + h.n_intervals * sizeof(T));
+    l.end = l.elements + h.n_elements * sizeof(T);
+    return l;
+  }
+  
+  // return if the n + 1 bounds start at 0, strictly increase and end at total, so that every range
+  // they delimit is in bounds and non-empty.
+  static bool valid_bounds(const uint64_t *bounds, uint64_t n, uint64_t total) {
+    if (bounds[0] != 0 || bounds[n] != total) return false;
+    for (uint64_t i = 0; i < n; ++i) {
+      if (bounds[i] >= bounds[i+1]) return false;
+    }
+    return true;
+  }
+  
+  // hand every gap of gaps over to the tree whose context is to, as gap::rehome does.
+  static void rehome_gaps(gap_tree &gaps, context *to) {
+    for (gap &g : gaps) g.rehome(to);
+  }
   
 public:
-  lazy_search_tree() : lst_size(0) {}
+  // order the elements by comp. A tree split from or joined with this one must order them the
+  // same way.
+  explicit lazy_search_tree(const Comp &comp = Comp()) : lst_size(0), ctx(new context(comp)),
+                                                       gap_ds(gap_compare(comp)) {}
+  
+  // pivot intervals of at least threshold elements on workers, which the caller keeps alive for
+  // as long as the tree uses it and may share between trees. Passing nullptr pivots serially.
+  void set_thread_pool(thread_pool *workers, unsigned long threshold = 1 << 20) {
+    ctx->workers = workers;
+    ctx->parallel_threshold = max(threshold, 1ul);
+    if (workers != own_workers.get()) own_workers.reset();
+  }
+  
+  // as set_thread_pool, on a pool of n_threads workers owned by the tree.
+  void use_threads(unsigned n_threads, unsigned long threshold = 1 << 20) {
+    thread_pool *workers = new thread_pool(n_threads);
+    set_thread_pool(workers, threshold);
+    own_workers.reset(workers);
+  }
+  
+  // choose pivots by rule; k is the number of samples for pivot_rule::median_of_k.
+  void set_pivot_rule(pivot_rule rule, unsigned k = 5) {
+    ctx->rule = rule;
+    ctx->pivot_samples = k;
+  }
+  
+  // reseed the generator pivots are sampled with, for reproducible restructuring.
+  void seed(unsigned long long s) {
+    ctx->rng = xorshift(s);
+  }
+  
+  // the restructuring policy, for policies that can be tuned.
+  Restructure& policy() { return restructure_policy; }
   
   void push(const T &key) {
     insert(key);
   }
   
+  // insert every key in keys. An empty tree takes over the vector's storage as a single unsorted
+  // gap, copying at most one chunk. Otherwise keys are bucketed by gap in one pass over the gap
+  // maxima and each gap receives its bucket at once, rather than searching the gap index per key.
+  void insert_bulk(vector<T> &&keys) {
+    if (keys.empty()) return;
+    unsigned long n = keys.size();
+    restructure_policy.inserted(n);
+    if (empty()) {
+      gap_ds.insert(gap(ctx.get(), std::move(keys)));
+      min_gap = gap_ds.end();
+    } else {
+      vector<gap_iterator> gaps;
+      vector<T> maxima;
+      for (gap_iterator it = gap_ds.begin(); it != gap_ds.end(); ++it) {
+        gaps.push_back(it);
+        maxima.push_back(it->get_max());
+      }
+      
+      // counting sort of the keys by destination gap. Keys beyond the last maximum go to the last gap.
+      vector<unsigned> dest(n);
+      vector<unsigned long> start(gaps.size() + 1, 0);
+      for (unsigned long i = 0; i < n; ++i) {
+        unsigned long g = std::lower_bound(maxima.begin(), maxima.end(), keys[i], ctx->comp) -
+                          maxima.begin();
+        dest[i] = (unsigned)min(g, (unsigned long)gaps.size() - 1);
+        ++start[dest[i] + 1];
+      }
+      for (unsigned long g = 0; g < gaps.size(); ++g) start[g+1] += start[g];
+      vector<T> bucketed(n);
+      vector<unsigned long> pos(start.begin(), start.end() - 1);
+      for (unsigned long i = 0; i < n; ++i) bucketed[pos[dest[i]]++] = keys[i];
+      
+      for (unsigned long g = 0; g < gaps.size(); ++g) {
+        if (start[g] != start[g+1]) {
+          gaps[g]->insert_bulk(bucketed.data() + start[g], bucketed.data() + start[g+1]);
+          gap_ds.refresh(gaps[g]);
+        }
+      }
+    }
+    lst_size += n;
+  }
+  
+  // replace the contents of the tree with the keys in [first, last).
+  template <typename Iterator>
+  void assign(Iterator first, Iterator last) {
+    clear();
+    insert_bulk(vector<T>(first, last));
+  }
+  
+  // answer count() for each of the n keys at once, writing the results to out. The keys are
+  // sorted and grouped by gap, and each gap is restructured once around all of its keys, instead
+  // of once per key.
+  void count_batch(const T *keys, unsigned long n, bool *out) {
+    if (empty()) {
+      for (unsigned long i = 0; i < n; ++i) out[i] = false;
+      return;
+    }
+    vector<unsigned long> order(n);
+    for (unsigned long i = 0; i < n; ++i) order[i] = i;
+    sort(order.begin(), order.end(), [this, keys](unsigned long a, unsigned long b) {
+      return ctx->before(keys[a], keys[b]);
+    });
+    
+    vector<T> pivots;
+    vector<unsigned long> pivot_of(n);
+    unsigned long i = 0;
+    while (i < n) {
+      gap &r_gap = gap_ds.lower_bound_or_last(keys[order[i]]);
+      // the gap receives every key up to its maximum, or every remaining key if it's the last gap.
+      bool last_gap = ctx->before(r_gap.get_max(), keys[order[i]]);
+      unsigned long j = i;
+      pivots.clear();
+      while (j < n && (last_gap || !ctx->before(r_gap.get_max(), keys[order[j]]))) {
+        if (pivots.empty() || ctx->before(pivots.back(), keys[order[j]])) {
+          pivots.push_back(keys[order[j]]);
+        }
+        pivot_of[j] = pivots.size() - 1;
+        ++j;
+      }
+      
+      unique_ptr<bool[]> found(new bool[pivots.size()]);
+      int depth = restructure_policy.depth(j - i, r_gap.add_hits(j - i), r_gap.size(),
+                                           r_gap.interval_size(pivots[0]));
+      vector<gap> new_gaps = r_gap.restructure(pivots.data(), pivots.size(), found.get(), depth);
+      gap_ds.erase(r_gap);  // note: this destroys r_gap.
+      min_gap = gap_ds.end();
+      for (gap &g : new_gaps) {
+        if (!g.empty()) gap_ds.insert(std::move(g));
+      }
+      for (; i < j; ++i) out[order[i]] = found[pivot_of[i]];
+    }
+  }
+  
+  // remove every key. Chunks carved by the pool are kept for reuse; buffers adopted by insert_bulk
+  // and mapped snapshots are released.
+  void clear() {
+    gap_ds.clear();
+    ctx->chunks.drop_kept();
+    min_gap = gap_ds.end();
+    lst_size = 0;
+  }
+  
   // insert key into the lazy search tree.
   void insert(const T &key) {
+    restructure_policy.inserted(1);
     if (empty()) {
-      gap r_gap = gap(key);
-      gap_ds.insert(r_gap);
+      gap_ds.emplace(ctx.get(), key);
+      min_gap = gap_ds.end();
     } else {
-      gap& r_gap = gap_ds.lower_bound_or_last(gap(key));
-      r_gap.insert(key);
+      // inserts are spread over the gaps, so splaying each one's gap would mostly add rotations;
+      // the bounded lookup only splays paths that skewed queries have made long.
+      gap_iterator r_gap = gap_ds.locate_bounded(key);
+      r_gap->insert(key);
+      gap_ds.refresh(r_gap);
     }
     ++lst_size;
   }
@@ -402,23 +1577,372 @@ public:
     if (empty()) {
       return false;
     } else {
-      gap &r_gap = gap_ds.lower_bound_or_last(gap(key));
+      gap &r_gap = gap_ds.lower_bound_or_last(key);
     //  r_gap.rebalance();  // First rebalance is unnecessary.
       bool result = r_gap.membership(key);
-      pair<gap, gap> new_gaps = r_gap.restructure(key, 2); // r_gap.restructure(key, INF);
-                                                           // INF will recurse
-                                                           // until intervals of size 1 are created,
-                                                           // the original algorithm.
-      gap_ds.erase(r_gap);  // note: this destroys r_gap.
-      if (!new_gaps.first.empty()) {
-        gap_ds.insert(new_gaps.first);
+      split_gap(r_gap, key);
+      return result;
+    }
+  }
+  
+  // return a pointer to an element equal to key, or nullptr if there is none, restructuring as
+  // count() does. The pointer stays valid until the tree is next modified or queried, and the
+  // element may be changed through it as long as it stays equal to key.
+  T* find(const T &key) {
+    if (empty()) return nullptr;
+    split_gap(gap_ds.lower_bound_or_last(key), key);
+    // key is now in the gap with the smallest maximum not before it, if anywhere.
+    gap_iterator it = gap_ds.locate(key);
+    return ctx->before(it->get_max(), key) ? nullptr : it->find(key);
+  }
+  
+  // return the element of rank k (0-indexed, so select(0) is the minimum) and restructure so that
+  // it becomes the maximum of its gap. Only the gap holding rank k is restructured. Undefined
+  // behavior if k >= size().
+  T select(unsigned long k) {
+    auto it = gap_ds.select(k);
+    gap &r_gap = *it;
+    pair<gap, gap> new_gaps = r_gap.restructure_rank(k);
+    T result = new_gaps.first.get_max();
+    gap_ds.erase(r_gap);  // note: this destroys r_gap.
+    min_gap = gap_ds.end();
+    gap_ds.insert(std::move(new_gaps.first));
+    if (!new_gaps.second.empty()) {
+      gap_ds.insert(std::move(new_gaps.second));
+    }
+    return result;
+  }
+  
+  // return the number of elements less than key, restructuring around key as count() does.
+  unsigned long rank(const T &key) {
+    if (empty()) return 0;
+    auto it = gap_ds.locate(key);
+    if (ctx->before(it->get_max(), key)) return size();
+    unsigned long n_before = gap_ds.weight_before(it);
+    gap &r_gap = *it;
+    pair<gap, gap> new_gaps = r_gap.restructure(key, query_depth(r_gap, key));
+    // elements equal to key may be on either side of the split; only those on the left are
+    // counted by its size.
+    unsigned long result = n_before + new_gaps.first.size();
+    if (!new_gaps.first.empty()) result -= new_gaps.first.count_trailing(key);
+    gap_ds.erase(r_gap);  // note: this destroys r_gap.
+    min_gap = gap_ds.end();
+    if (!new_gaps.first.empty()) {
+      gap_ds.insert(std::move(new_gaps.first));
+    }
+    if (!new_gaps.second.empty()) {
+      gap_ds.insert(std::move(new_gaps.second));
+    }
+    return result;
+  }
+  
+  // call f on every element e with lo <= e < hi, in no particular order. The gaps holding lo and
+  // hi are restructured around them as a query for each would; the gaps and intervals between
+  // them are streamed whole, a chunk at a time, without being sorted or compared. f must not
+  // modify the tree.
+  template<typename F>
+  void for_each_in_range(const T &lo, const T &hi, F f) {
+    if (empty() || !ctx->before(lo, hi)) return;
+    split_gap(gap_ds.lower_bound_or_last(lo), lo);
+    split_gap(gap_ds.lower_bound_or_last(hi), hi);
+    gap_iterator it = gap_ds.locate(lo);
+    if (ctx->before(it->get_max(), lo)) return;
+    bool at_least_lo = false;
+    for (; it != gap_ds.end(); ++it) {
+      bool below_hi = ctx->before(it->get_max(), hi);
+      if (at_least_lo && below_hi) {
+        it->for_each(f);
+      } else {
+        it->for_each_between(lo, hi, at_least_lo, f);
       }
-      if (!new_gaps.second.empty()) {
-        gap_ds.insert(new_gaps.second);
+      // every element of later gaps is >= the maximum of this one, which is >= lo.
+      if (!below_hi) break;
+      at_least_lo = true;
+    }
+  }
+  
+  // move every element not before key into right, which must be empty, leaving the elements
+  // before key in this tree. The gap holding key is restructured around it as count() would, and
+  // the gap index is then split between the two pieces, so no element is moved or compared beyond
+  // that gap. The gaps moved keep their chunks and their nodes in the gap index, whose storage the
+  // two trees share from then on; only the gaps' pointers to their tree are updated, one per gap
+  // and interval moved.
+  void split(const T &key, lazy_search_tree &right) {
+    assert(right.empty());
+    if (gap_starting_at(key) == gap_ds.end()) return;
+    gap_ds.split(key, right.gap_ds);
+    right.ctx->chunks.share(ctx->chunks);
+    rehome_gaps(right.gap_ds, right.ctx.get());
+    right.lst_size = right.gap_ds.total_weight();
+    lst_size -= right.lst_size;
+    min_gap = gap_ds.end();
+    right.min_gap = right.gap_ds.end();
+  }
+  
+  // move every element of right, all of which must be greater than the elements of this tree, to
+  // this tree, leaving right empty. The gaps of right are appended to the gap index as they are,
+  // without restructuring, and their chunks and nodes are taken over along with right's pools.
+  void join(lazy_search_tree &right) {
+    if (right.empty()) return;
+    assert(empty() || right.gap_ds.begin()->all_after(gap_ds.maximum().get_max()));
+    rehome_gaps(right.gap_ds, ctx.get());
+    ctx->chunks.absorb(right.ctx->chunks);
+    gap_ds.join(right.gap_ds);
+    lst_size += right.lst_size;
+    right.lst_size = 0;
+    min_gap = gap_ds.end();
+    right.min_gap = right.gap_ds.end();
+  }
+  
+  // write the tree to the file at path, replacing it, and return if that succeeded. The snapshot
+  // keeps the gaps and intervals as they are, so the restructuring done so far survives a
+  // restart; see lst_snapshot_header for the format. T must be trivially copyable. The file is
+  // written beside path and renamed over it, so a tree loaded from path, whose elements may still
+  // be mapped from it, can be saved back to it, and a failed save leaves the old snapshot intact.
+  bool save(const string &path) {
+    static_assert(is_trivially_copyable<T>::value, "save requires a trivially copyable T");
+    static_assert(alignof(T) <= snapshot_align, "T is aligned more strictly than a snapshot");
+    vector<uint64_t> gap_bounds(1, 0), interval_bounds(1, 0);
+    vector<double> hits;
+    vector<T> maxima;
+    for (const gap &g : gap_ds) {
+      g.describe(interval_bounds, maxima);
+      gap_bounds.push_back(maxima.size());
+      hits.push_back(g.get_hits());
+    }
+    lst_snapshot_header h;
+    memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+    h.element_size = sizeof(T);
+    h.n_gaps = hits.size();
+    h.n_intervals = maxima.size();
+    h.n_elements = lst_size;
+    snapshot_layout l = layout_of(h);
+    
+    string temp_path = path + ".tmp";
+    ofstream out(temp_path, ios::binary | ios::trunc);
+    uint64_t at = 0;
+    auto write_at = [&](uint64_t offset, const void *data, uint64_t bytes) {
+      static const char zeros[snapshot_align] = {};
+      out.write(zeros, offset - at);
+      out.write(static_cast<const char*>(data), bytes);
+      at = offset + bytes;
+    };
+    write_at(0, &h, sizeof(h));
+    write_at(l.gap_bounds, gap_bounds.data(), gap_bounds.size() * sizeof(uint64_t));
+    write_at(l.gap_hits, hits.data(), hits.size() * sizeof(double));
+    write_at(l.interval_bounds, interval_bounds.data(), interval_bounds.size() * sizeof(uint64_t));
+    write_at(l.interval_maxima, maxima.data(), maxima.size() * sizeof(T));
+    write_at(l.elements, nullptr, 0);
+    for (const gap &g : gap_ds) g.write_elements(out);
+    out.close();
+    if (out.fail() || rename(temp_path.c_str(), path.c_str()) != 0) {
+      remove(temp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+  
+  // replace the contents of the tree with the snapshot at path, and return if that succeeded;
+  // the tree is left unchanged if not. The file is mapped copy-on-write rather than read: the
+  // gaps and intervals are rebuilt from its tables, but the elements are used where they lie,
+  // every full chunk of an interval pointing into the mapping, so loading costs O(gaps +
+  // intervals) and pages are only read when queries reach them. The first write to a page, by a
+  // pivot or an insert, gives the tree a private copy of it and the file is never modified.
+  bool load(const string &path) {
+    static_assert(is_trivially_copyable<T>::value, "load requires a trivially copyable T");
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(lst_snapshot_header)) {
+      close(fd);
+      return false;
+    }
+    uint64_t length = st.st_size;
+    void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+    shared_ptr<void> mapping(base, [length](void *p) { munmap(p, length); });
+
+    char *bytes = static_cast<char*>(base);
+    const lst_snapshot_header &h = *reinterpret_cast<const lst_snapshot_header*>(bytes);
+    if (memcmp(h.magic, snapshot_magic, sizeof(h.magic)) != 0 || h.element_size != sizeof(T)) {
+      return false;
+    }
+    // counts past the file size would overflow the layout.
+    if (h.n_gaps > length || h.n_intervals > length || h.n_elements > length) return false;
+    snapshot_layout l = layout_of(h);
+    if (l.end != length) return false;
+    const uint64_t *gap_bounds = reinterpret_cast<const uint64_t*>(bytes + l.gap_bounds);
+    const double *hits = reinterpret_cast<const double*>(bytes + l.gap_hits);
+    const uint64_t *interval_bounds = reinterpret_cast<const uint64_t*>(bytes + l.interval_bounds);
+    const T *maxima = reinterpret_cast<const T*>(bytes + l.interval_maxima);
+    T *elements = reinterpret_cast<T*>(bytes + l.elements);
+    if (!valid_bounds(gap_bounds, h.n_gaps, h.n_intervals) ||
+        !valid_bounds(interval_bounds, h.n_intervals, h.n_elements)) {
+      return false;
+    }
+
+    clear();
+    if (h.n_elements > 0) ctx->chunks.keep(elements, mapping);
+    for (uint64_t i = 0; i < h.n_gaps; ++i) {
+      gap_ds.insert(gap(ctx.get(), elements, interval_bounds + gap_bounds[i],
+                        maxima + gap_bounds[i], gap_bounds[i+1] - gap_bounds[i], hits[i]));
+    }
+    lst_size = h.n_elements;
+    restructure_policy.inserted(lst_size);
+    return true;
+  }
+  
+  // return the number of elements e with lo <= e < hi. Each bound restructures as rank does, and
+  // the count comes from the gap weights without visiting the gaps in between.
+  unsigned long count_range(const T &lo, const T &hi) {
+    if (!ctx->before(lo, hi)) return 0;
+    unsigned long below_lo = rank(lo);
+    return rank(hi) - below_lo;
+  }
+  
+  // an input iterator over the elements in sorted order. Each gap it reaches is first split, by
+  // pivoting its first interval as top() does, until its smallest elements form a gap of at most
+  // sorted_piece elements, which the iterator copies and sorts; see split_for_iteration. Only the
+  // part of the tree iterated over is restructured, and the gaps it is cut into stay in the tree,
+  // so a partial iteration leaves the tree that much more refined and iterating again is cheap.
+  // Iterators stay valid while the tree is only iterated; any other operation on the tree
+  // invalidates them. References point into the iterator's own copy of the gap and last only until
+  // it is advanced or destroyed, so it is an input iterator, not a forward one.
+  class iterator {
+  private:
+    lazy_search_tree *tree;
+    gap_iterator g;
+    vector<T> sorted;  // the elements of *g, in order.
+    unsigned long pos;
+    friend class lazy_search_tree;
+    
+    iterator(lazy_search_tree *tree, gap_iterator g) : tree(tree), g(g), pos(0) { load(); }
+    
+    void load() {
+      sorted.clear();
+      pos = 0;
+      if (g == tree->gap_ds.end()) return;
+      g = tree->split_for_iteration(g);
+      g->append_to(sorted);
+      sort(sorted.begin(), sorted.end(), tree->ctx->comp);
+    }
+    
+  public:
+    typedef input_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const T* pointer;
+    typedef const T& reference;
+    
+    iterator() : tree(nullptr), pos(0) {}
+    
+    const T& operator*() const { return sorted[pos]; }
+    const T* operator->() const { return &sorted[pos]; }
+    
+    iterator& operator++() {
+      if (++pos == sorted.size()) {
+        ++g;
+        load();
       }
-      
-      return result;
+      return *this;
+    }
+    
+    iterator operator++(int) {
+      iterator old = *this;
+      ++*this;
+      return old;
     }
+    
+    bool operator==(const iterator &other) const { return g == other.g && pos == other.pos; }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+  };
+  
+  iterator begin() { return iterator(this, gap_ds.begin()); }
+  iterator end() { return iterator(this, gap_ds.end()); }
+  
+  // return an iterator to the first element not before key, or end() if there is none. The gap
+  // holding key is restructured once so that key starts a gap, as in split, so no element before
+  // key is sorted or stepped over.
+  iterator lower_bound(const T &key) { return iterator(this, gap_starting_at(key)); }
+  
+  // remove every element equal to key and return how many were removed.
+  unsigned long erase(const T &key) {
+    return erase_between(key, key, true, nullptr);
+  }
+  
+  // remove every element equal to key, appending them to out, and return how many were removed.
+  unsigned long extract(const T &key, vector<T> &out) {
+    return erase_between(key, key, true, &out);
+  }
+  
+  // remove every element e with lo <= e < hi and return how many were removed.
+  unsigned long erase_range(const T &lo, const T &hi) {
+    if (!ctx->before(lo, hi)) return 0;
+    return erase_between(lo, hi, false, nullptr);
+  }
+  
+  // remove every element e with lo <= e < hi, appending them to out in no particular order, and
+  // return how many were moved. Whole gaps and intervals inside the range are copied out a chunk
+  // at a time, without being scanned.
+  unsigned long extract_range(const T &lo, const T &hi, vector<T> &out) {
+    if (!ctx->before(lo, hi)) return 0;
+    return erase_between(lo, hi, false, &out);
+  }
+  
+  // return the smallest element, restructuring only the first interval of the first gap until it
+  // holds that element alone. Undefined behavior if the tree is empty.
+  T top() {
+    return first_gap()->front();
+  }
+  
+  // remove the smallest element. Undefined behavior if the tree is empty.
+  void pop() {
+    gap_iterator it = first_gap();
+    it->pop_front();
+    if (it->empty()) {
+      ++min_gap;
+      gap_ds.erase(it);
+    } else {
+      gap_ds.refresh(it);
+    }
+    --lst_size;
+  }
+  
+  // do up to about max_elements worth of the restructuring that queries would otherwise do, and
+  // return how much was done; 0 means the tree is already fully refined. The gaps holding the
+  // largest intervals are split first, as if queried at an element of that interval, so later
+  // queries find small intervals wherever they land. Meant to be called when the tree is idle.
+  unsigned long refine(unsigned long max_elements) {
+    return refine_while([max_elements](unsigned long work) { return work < max_elements; });
+  }
+  
+  // as refine, but for about the given time rather than a number of elements.
+  template<typename Rep, typename Period>
+  unsigned long refine_for(chrono::duration<Rep, Period> budget) {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + budget;
+    return refine_while([deadline](unsigned long) {
+      return chrono::steady_clock::now() < deadline;
+    });
+  }
+  
+  // return the counters, which are zero unless compiled with LST_STATS, and the current shape of
+  // the tree. The shape is found by walking every gap, in O(gaps + intervals) time.
+  lst_stats stats() {
+    lst_stats s;
+    static_cast<lst_counters&>(s) = ctx->counters;
+    s.rotations = gap_ds.rotations() - ctx->counters.rotations;
+    s.size = lst_size;
+    s.n_gaps = gap_ds.size();
+    for (gap_iterator it = gap_ds.begin(); it != gap_ds.end(); ++it) it->add_shape(s);
+    return s;
+  }
+  
+  // zero the counters, so that the next stats covers only the work done from here on.
+  void reset_stats() {
+    ctx->counters = lst_counters();
+    // rotations are counted by the gap index, so this keeps the count to subtract.
+    ctx->counters.rotations = gap_ds.rotations();
   }
   
   void print() {
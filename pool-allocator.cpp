@@ -0,0 +1,153 @@
+// A pooled allocator for fixed-size objects, such as the nodes of a splay tree. Objects are carved
+// out of contiguous blocks and freed objects are kept on a free list for reuse, so a tree makes
+// O(log n) calls to the system allocator instead of one per node. All blocks are released at once
+// when the last allocator holding them is destroyed.
+
+// Each allocator owns its own pool. Copies start with an empty pool and only compare equal to
+// themselves, so memory must be returned to the allocator it came from, or to one that has since
+// shared that allocator's blocks. Sharing lets a container hand a linked structure over to another
+// without rebuilding it, as chunk_pool does for chunks. Requests for more than one object at a
+// time bypass the pool.
+
+#ifndef POOL_ALLOCATOR
+#define POOL_ALLOCATOR
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<typename T>
+class pool_allocator {
+private:
+  // a slot holds either a live object or, once freed, a link in the free list.
+  union slot {
+    slot *next;
+    alignas(T) char storage[sizeof(T)];
+  };
+
+  static const std::size_t first_block_slots = 64;
+  static const std::size_t max_block_slots = 65536;
+
+  slot *free_list;
+  slot *free_last;  // the end of the free list, so that absorb can splice it in O(1).
+  slot *block_next, *block_end;
+  std::size_t next_block_slots;
+  // the blocks this pool carved or shares, sorted by address. Each is freed along with its last
+  // owner.
+  std::vector<std::shared_ptr<slot>> blocks;
+
+  // allocate a new block, doubling the block size up to max_block_slots so locality improves
+  // as the pool grows without overcommitting small pools.
+  void grow() {
+    slot *block = static_cast<slot*>(::operator new(next_block_slots * sizeof(slot)));
+    std::shared_ptr<slot> owner(block, [](slot *b) { ::operator delete(b); });
+    blocks.insert(std::upper_bound(blocks.begin(), blocks.end(), owner), std::move(owner));
+    block_next = block;
+    block_end = block + next_block_slots;
+    if (next_block_slots < max_block_slots) next_block_slots *= 2;
+  }
+
+public:
+  typedef T value_type;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  typedef std::false_type is_always_equal;
+
+  template<typename U> struct rebind { typedef pool_allocator<U> other; };
+
+  pool_allocator() : free_list(nullptr), free_last(nullptr), block_next(nullptr),
+                     block_end(nullptr), next_block_slots(first_block_slots) { }
+
+  // copies never share a pool.
+  pool_allocator(const pool_allocator&) : pool_allocator() { }
+  template<typename U> pool_allocator(const pool_allocator<U>&) : pool_allocator() { }
+
+  pool_allocator(pool_allocator &&other) : pool_allocator() { swap(other); }
+
+  pool_allocator& operator=(const pool_allocator&) { return *this; }
+  pool_allocator& operator=(pool_allocator &&other) {
+    if (this != &other) {
+      release();
+      swap(other);
+    }
+    return *this;
+  }
+
+  ~pool_allocator() { release(); }
+
+  T* allocate(std::size_t n) {
+    if (n != 1) return static_cast<T*>(::operator new(n * sizeof(T)));
+    slot *s;
+    if (free_list) {
+      s = free_list;
+      free_list = free_list->next;
+    } else {
+      if (block_next == block_end) grow();
+      s = block_next++;
+    }
+    return reinterpret_cast<T*>(s);
+  }
+
+  void deallocate(T *p, std::size_t n) {
+    if (n != 1) {
+      ::operator delete(p);
+      return;
+    }
+    slot *s = reinterpret_cast<slot*>(p);
+    if (!free_list) free_last = s;
+    s->next = free_list;
+    free_list = s;
+  }
+
+  // let go of every block, returning those no other pool shares to the system. Any objects still
+  // allocated from them are invalidated without being destroyed.
+  void release() {
+    blocks.clear();
+    free_list = free_last = block_next = block_end = nullptr;
+    next_block_slots = first_block_slots;
+  }
+
+  // keep every block of other alive for as long as this pool, so that objects other allocated can
+  // be handed over and later deallocated through this pool. O(number of blocks), which grows
+  // logarithmically until blocks reach max_block_slots.
+  void share(const pool_allocator &other) {
+    if (&other == this) return;
+    std::vector<std::shared_ptr<slot>> merged;
+    merged.reserve(blocks.size() + other.blocks.size());
+    std::set_union(blocks.begin(), blocks.end(), other.blocks.begin(), other.blocks.end(),
+                   std::back_inserter(merged));
+    blocks.swap(merged);
+  }
+
+  // as share, and also take over the free list of other, whose pool stays usable.
+  void absorb(pool_allocator &other) {
+    share(other);
+    if (&other == this || !other.free_list) return;
+    other.free_last->next = free_list;
+    if (!free_list) free_last = other.free_last;
+    free_list = other.free_list;
+    other.free_list = other.free_last = nullptr;
+  }
+
+  void swap(pool_allocator &other) {
+    std::swap(free_list, other.free_list);
+    std::swap(free_last, other.free_last);
+    std::swap(block_next, other.block_next);
+    std::swap(block_end, other.block_end);
+    std::swap(next_block_slots, other.next_block_slots);
+    blocks.swap(other.blocks);
+  }
+
+  bool operator==(const pool_allocator &other) const { return this == &other; }
+  bool operator!=(const pool_allocator &other) const { return this != &other; }
+};
+
+#endif // POOL_ALLOCATOR
@@ -0,0 +1,79 @@
+// Policies deciding how deeply a query restructures the interval it lands in. Every query pivots
+// that interval at the query key; the depth is how many more times each of the two pieces next to
+// the key is split around a sampled element. Depth 0 does the least work per query, and INF splits
+// down to single elements, which is the original algorithm and amounts to sorting the region.
+
+// A policy is told of every insert and every query, so it can follow the workload:
+//   void inserted(unsigned long n)
+//     n elements were inserted.
+//   int depth(unsigned long n_queries, double gap_hits, unsigned long gap_size,
+//             unsigned long interval_size)
+//     n_queries queries, answered together, landed in a gap of gap_size elements, in an interval
+//     of interval_size elements. gap_hits is the number of queries that have landed in the gap or,
+//     in proportion to its share, in the gaps it was split from. Returns the depth to use.
+//     refine asks with n_queries 0 before splitting a gap ahead of any query.
+
+#ifndef RESTRUCTURE_POLICY
+#define RESTRUCTURE_POLICY
+
+#include <algorithm>
+#include <cmath>
+
+#ifndef INF
+#define INF 1000000000
+#endif
+
+// always restructure to depth D.
+template<int D>
+struct fixed_depth {
+  void inserted(unsigned long) {}
+  int depth(unsigned long, double, unsigned long, unsigned long) { return D; }
+};
+
+// always split down to single elements, as the original algorithm does.
+struct full_depth {
+  void inserted(unsigned long) {}
+  int depth(unsigned long, double, unsigned long, unsigned long) { return INF; }
+};
+
+// picks the depth from the observed density of queries, in queries per element. An interval of s
+// elements is expected to draw about density * s queries before inserts double its size, and each
+// of them would split it about once more, so it is split that many levels deep right away: barely
+// at all while inserts dominate, and all the way down once there are about as many queries as
+// inserts. The density is the larger of the recent ratio of queries to inserts across the tree and
+// the hits per element of the gap queried, so hot key ranges are sorted before cold ones.
+class adaptive_depth {
+private:
+  // counts of recent queries and inserts, both halved whenever their sum exceeds window.
+  double queries, inserts;
+  double window;
+
+  void decay() {
+    while (queries + inserts > window) {
+      queries /= 2;
+      inserts /= 2;
+    }
+  }
+
+public:
+  explicit adaptive_depth(unsigned long window = 1 << 16)
+      : queries(0), inserts(0), window((double)window) {}
+
+  void inserted(unsigned long n) {
+    inserts += n;
+    decay();
+  }
+
+  int depth(unsigned long n_queries, double gap_hits, unsigned long gap_size,
+            unsigned long interval_size) {
+    queries += n_queries;
+    decay();
+    double density = std::max(queries / std::max(inserts, 1.0),
+                              gap_hits / std::max(gap_size, 1ul));
+    double expected = density * interval_size;
+    if (expected >= interval_size) return INF;
+    return (int)std::log2(1 + expected);
+  }
+};
+
+#endif // RESTRUCTURE_POLICY
@@ -0,0 +1,429 @@
+// Vectorized kernels for the two loops that touch every element of an interval: the membership
+// scan and the pivot partition. int32_t, int64_t, float and double get AVX2 and AVX-512 versions,
+// chosen at runtime from what the CPU supports; every other type, every ordering other than
+// std::less, and builds for other targets or with LST_NO_SIMD defined, use the scalar versions,
+// which compare through the comparator they are passed. All versions produce identical results.
+
+// The partition writes whole vector registers, so its output buffers need simd_slack elements of
+// room past the last element written.
+
+#ifndef SIMD_KERNELS
+#define SIMD_KERNELS
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+#if !defined(LST_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define LST_SIMD_X86
+#include <immintrin.h>
+#endif
+
+enum simd_level { simd_scalar = 0, simd_avx2 = 1, simd_avx512 = 2 };
+
+// types with vectorized kernels.
+template<typename T>
+struct simd_supported : std::integral_constant<bool,
+    std::is_same<T, int32_t>::value || std::is_same<T, int64_t>::value ||
+    std::is_same<T, float>::value || std::is_same<T, double>::value> {};
+
+// orderings with vectorized kernels: std::less on a supported type.
+template<typename T, typename Comp>
+struct simd_enabled : std::integral_constant<bool,
+    simd_supported<T>::value && std::is_same<Comp, std::less<T>>::value> {};
+
+static const unsigned long simd_slack = 16;
+
+inline simd_level detect_simd_level() {
+#ifdef LST_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return simd_avx512;
+  if (__builtin_cpu_supports("avx2")) return simd_avx2;
+#endif
+  return simd_scalar;
+}
+
+inline simd_level& simd_level_setting() {
+  static simd_level level = detect_simd_level();
+  return level;
+}
+
+// the instruction set the kernels currently use.
+inline simd_level active_simd_level() { return simd_level_setting(); }
+
+// restrict the kernels to at most the given instruction set, e.g. to compare against the scalar
+// versions. Cannot raise the level above what the CPU supports.
+inline void limit_simd_level(simd_level max_level) {
+  if (max_level < simd_level_setting()) simd_level_setting() = max_level;
+}
+
+// the smallest value of T, used as the identity when taking a maximum.
+template<typename T>
+T simd_lowest() {
+  return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity()
+                                              : std::numeric_limits<T>::lowest();
+}
+
+template<typename T, typename Comp = std::less<T>>
+bool scalar_contains(const T *data, unsigned long n, const T &key, Comp comp = Comp()) {
+  for (unsigned long i = 0; i < n; ++i) {
+    if (!comp(key, data[i]) && !comp(data[i], key)) return true;
+  }
+  return false;
+}
+
+// partition src[0, n) around p, appending elements < p to lesser and elements > p to greater.
+// Elements equal to p alternate sides, starting with lesser when toggle is false. n_lesser and
+// n_greater are advanced, and lesser_max is raised to the largest element written to lesser.
+template<typename T, typename Comp = std::less<T>>
+void scalar_partition(const T *src, unsigned long n, const T &p, T *lesser,
+                      unsigned long &n_lesser, T *greater, unsigned long &n_greater,
+                      bool &toggle, T &lesser_max, Comp comp = Comp()) {
+  for (unsigned long i = 0; i < n; ++i) {
+    const T &e = src[i];
+    bool left;
+    if (comp(e, p)) left = true;
+    else if (comp(p, e)) left = false;
+    else left = (toggle = !toggle);
+    if (left) {
+      if (n_lesser == 0 || comp(lesser_max, e)) lesser_max = e;
+      lesser[n_lesser++] = e;
+    } else {
+      greater[n_greater++] = e;
+    }
+  }
+}
+
+#ifdef LST_SIMD_X86
+
+#define LST_AVX2 __attribute__((target("avx2")))
+#define LST_AVX512 __attribute__((target("avx512f")))
+
+// permutations that move the lanes selected by a mask to the front of a 256-bit register, which
+// AVX2 needs to emulate compress-store. Indices are 32-bit lanes; 64-bit lanes use pairs.
+struct avx2_compress_tables {
+  alignas(32) uint32_t lanes32[256][8];
+  alignas(32) uint32_t lanes64[16][8];
+
+  avx2_compress_tables() {
+    for (int m = 0; m < 256; ++m) {
+      int k = 0;
+      for (int i = 0; i < 8; ++i) {
+        if ((m >> i) & 1) lanes32[m][k++] = i;
+      }
+      while (k < 8) lanes32[m][k++] = 0;
+    }
+    for (int m = 0; m < 16; ++m) {
+      int k = 0;
+      for (int i = 0; i < 4; ++i) {
+        if ((m >> i) & 1) {
+          lanes64[m][k++] = 2*i;
+          lanes64[m][k++] = 2*i + 1;
+        }
+      }
+      while (k < 8) lanes64[m][k++] = 0;
+    }
+  }
+};
+
+inline const avx2_compress_tables& compress_tables() {
+  static const avx2_compress_tables tables;
+  return tables;
+}
+
+// per-type AVX2 operations. Comparisons return lane masks; mask() packs them into an int.
+template<typename T> struct avx2_ops;
+
+template<> struct avx2_ops<int32_t> {
+  typedef __m256i vec;
+  static const int width = 8;
+  LST_AVX2 static vec load(const int32_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+  LST_AVX2 static vec set1(int32_t v) { return _mm256_set1_epi32(v); }
+  LST_AVX2 static vec eq(vec a, vec b) { return _mm256_cmpeq_epi32(a, b); }
+  LST_AVX2 static vec lt(vec a, vec b) { return _mm256_cmpgt_epi32(b, a); }
+  LST_AVX2 static int mask(vec m) { return _mm256_movemask_ps(_mm256_castsi256_ps(m)); }
+  LST_AVX2 static vec max(vec a, vec b) { return _mm256_max_epi32(a, b); }
+  LST_AVX2 static vec select(vec m, vec a, vec b) { return _mm256_blendv_epi8(b, a, m); }
+  LST_AVX2 static void compress_store(int32_t *out, vec x, int m) {
+    __m256i idx = _mm256_load_si256((const __m256i*)compress_tables().lanes32[m]);
+    _mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(x, idx));
+  }
+};
+
+template<> struct avx2_ops<int64_t> {
+  typedef __m256i vec;
+  static const int width = 4;
+  LST_AVX2 static vec load(const int64_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+  LST_AVX2 static vec set1(int64_t v) { return _mm256_set1_epi64x(v); }
+  LST_AVX2 static vec eq(vec a, vec b) { return _mm256_cmpeq_epi64(a, b); }
+  LST_AVX2 static vec lt(vec a, vec b) { return _mm256_cmpgt_epi64(b, a); }
+  LST_AVX2 static int mask(vec m) { return _mm256_movemask_pd(_mm256_castsi256_pd(m)); }
+  LST_AVX2 static vec max(vec a, vec b) { return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(b, a)); }
+  LST_AVX2 static vec select(vec m, vec a, vec b) { return _mm256_blendv_epi8(b, a, m); }
+  LST_AVX2 static void compress_store(int64_t *out, vec x, int m) {
+    __m256i idx = _mm256_load_si256((const __m256i*)compress_tables().lanes64[m]);
+    _mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(x, idx));
+  }
+};
+
+template<> struct avx2_ops<float> {
+  typedef __m256 vec;
+  static const int width = 8;
+  LST_AVX2 static vec load(const float *p) { return _mm256_loadu_ps(p); }
+  LST_AVX2 static vec set1(float v) { return _mm256_set1_ps(v); }
+  LST_AVX2 static vec eq(vec a, vec b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+  LST_AVX2 static vec lt(vec a, vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  LST_AVX2 static int mask(vec m) { return _mm256_movemask_ps(m); }
+  LST_AVX2 static vec max(vec a, vec b) { return _mm256_max_ps(a, b); }
+  LST_AVX2 static vec select(vec m, vec a, vec b) { return _mm256_blendv_ps(b, a, m); }
+  LST_AVX2 static void compress_store(float *out, vec x, int m) {
+    __m256i idx = _mm256_load_si256((const __m256i*)compress_tables().lanes32[m]);
+    _mm256_storeu_ps(out, _mm256_permutevar8x32_ps(x, idx));
+  }
+};
+
+template<> struct avx2_ops<double> {
+  typedef __m256d vec;
+  static const int width = 4;
+  LST_AVX2 static vec load(const double *p) { return _mm256_loadu_pd(p); }
+  LST_AVX2 static vec set1(double v) { return _mm256_set1_pd(v); }
+  LST_AVX2 static vec eq(vec a, vec b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+  LST_AVX2 static vec lt(vec a, vec b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+  LST_AVX2 static int mask(vec m) { return _mm256_movemask_pd(m); }
+  LST_AVX2 static vec max(vec a, vec b) { return _mm256_max_pd(a, b); }
+  LST_AVX2 static vec select(vec m, vec a, vec b) { return _mm256_blendv_pd(b, a, m); }
+  LST_AVX2 static void compress_store(double *out, vec x, int m) {
+    __m256i idx = _mm256_load_si256((const __m256i*)compress_tables().lanes64[m]);
+    __m256 packed = _mm256_permutevar8x32_ps(_mm256_castpd_ps(x), idx);
+    _mm256_storeu_pd(out, _mm256_castps_pd(packed));
+  }
+};
+
+template<typename T>
+LST_AVX2 bool avx2_contains(const T *data, unsigned long n, T key) {
+  typedef avx2_ops<T> ops;
+  const unsigned long w = ops::width;
+  typename ops::vec k = ops::set1(key);
+  unsigned long i = 0;
+  for (; i + 4*w <= n; i += 4*w) {
+    int hit = ops::mask(ops::eq(ops::load(data + i), k)) |
+              ops::mask(ops::eq(ops::load(data + i + w), k)) |
+              ops::mask(ops::eq(ops::load(data + i + 2*w), k)) |
+              ops::mask(ops::eq(ops::load(data + i + 3*w), k));
+    if (hit) return true;
+  }
+  for (; i + w <= n; i += w) {
+    if (ops::mask(ops::eq(ops::load(data + i), k))) return true;
+  }
+  return scalar_contains(data + i, n - i, key);
+}
+
+template<typename T>
+LST_AVX2 unsigned long avx2_partition(const T *src, unsigned long n, T p, T *lesser, T *greater,
+                                      bool &toggle, T &lesser_max) {
+  typedef avx2_ops<T> ops;
+  const unsigned long w = ops::width;
+  const int all = (1 << w) - 1;
+  typename ops::vec pv = ops::set1(p), lowest = ops::set1(simd_lowest<T>()), vmax = lowest;
+  unsigned long n_lesser = 0, n_greater = 0, i = 0;
+  T smax = simd_lowest<T>();
+  for (; i + w <= n; i += w) {
+    typename ops::vec x = ops::load(src + i);
+    typename ops::vec l = ops::lt(x, pv);
+    int lm = ops::mask(l), gm = ops::mask(ops::lt(pv, x));
+    if ((lm | gm) != all) {
+      // an element equals the pivot; keep the alternation in element order.
+      scalar_partition(src + i, w, p, lesser, n_lesser, greater, n_greater, toggle, smax);
+      continue;
+    }
+    ops::compress_store(lesser + n_lesser, x, lm);
+    ops::compress_store(greater + n_greater, x, gm);
+    n_lesser += __builtin_popcount(lm);
+    n_greater += __builtin_popcount(gm);
+    vmax = ops::max(vmax, ops::select(l, x, lowest));
+  }
+  scalar_partition(src + i, n - i, p, lesser, n_lesser, greater, n_greater, toggle, smax);
+  T lanes[ops::width];
+  std::memcpy(lanes, &vmax, sizeof(lanes));
+  for (unsigned long j = 0; j < w; ++j) {
+    if (smax < lanes[j]) smax = lanes[j];
+  }
+  lesser_max = smax;
+  return n_lesser;
+}
+
+// per-type AVX-512 operations. Comparisons return mask registers.
+template<typename T> struct avx512_ops;
+
+template<> struct avx512_ops<int32_t> {
+  typedef __m512i vec;
+  typedef __mmask16 mask;
+  static const int width = 16;
+  LST_AVX512 static vec load(const int32_t *p) { return _mm512_loadu_si512(p); }
+  LST_AVX512 static vec set1(int32_t v) { return _mm512_set1_epi32(v); }
+  LST_AVX512 static mask eq(vec a, vec b) { return _mm512_cmpeq_epi32_mask(a, b); }
+  LST_AVX512 static mask lt(vec a, vec b) { return _mm512_cmplt_epi32_mask(a, b); }
+  LST_AVX512 static vec max(vec acc, mask m, vec x) { return _mm512_mask_max_epi32(acc, m, acc, x); }
+  LST_AVX512 static void compress_store(int32_t *out, vec x, mask m) {
+    _mm512_storeu_si512(out, _mm512_maskz_compress_epi32(m, x));
+  }
+};
+
+template<> struct avx512_ops<int64_t> {
+  typedef __m512i vec;
+  typedef __mmask8 mask;
+  static const int width = 8;
+  LST_AVX512 static vec load(const int64_t *p) { return _mm512_loadu_si512(p); }
+  LST_AVX512 static vec set1(int64_t v) { return _mm512_set1_epi64(v); }
+  LST_AVX512 static mask eq(vec a, vec b) { return _mm512_cmpeq_epi64_mask(a, b); }
+  LST_AVX512 static mask lt(vec a, vec b) { return _mm512_cmplt_epi64_mask(a, b); }
+  LST_AVX512 static vec max(vec acc, mask m, vec x) { return _mm512_mask_max_epi64(acc, m, acc, x); }
+  LST_AVX512 static void compress_store(int64_t *out, vec x, mask m) {
+    _mm512_storeu_si512(out, _mm512_maskz_compress_epi64(m, x));
+  }
+};
+
+template<> struct avx512_ops<float> {
+  typedef __m512 vec;
+  typedef __mmask16 mask;
+  static const int width = 16;
+  LST_AVX512 static vec load(const float *p) { return _mm512_loadu_ps(p); }
+  LST_AVX512 static vec set1(float v) { return _mm512_set1_ps(v); }
+  LST_AVX512 static mask eq(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+  LST_AVX512 static mask lt(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  LST_AVX512 static vec max(vec acc, mask m, vec x) { return _mm512_mask_max_ps(acc, m, acc, x); }
+  LST_AVX512 static void compress_store(float *out, vec x, mask m) {
+    _mm512_storeu_ps(out, _mm512_maskz_compress_ps(m, x));
+  }
+};
+
+template<> struct avx512_ops<double> {
+  typedef __m512d vec;
+  typedef __mmask8 mask;
+  static const int width = 8;
+  LST_AVX512 static vec load(const double *p) { return _mm512_loadu_pd(p); }
+  LST_AVX512 static vec set1(double v) { return _mm512_set1_pd(v); }
+  LST_AVX512 static mask eq(vec a, vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ); }
+  LST_AVX512 static mask lt(vec a, vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+  LST_AVX512 static vec max(vec acc, mask m, vec x) { return _mm512_mask_max_pd(acc, m, acc, x); }
+  LST_AVX512 static void compress_store(double *out, vec x, mask m) {
+    _mm512_storeu_pd(out, _mm512_maskz_compress_pd(m, x));
+  }
+};
+
+template<typename T>
+LST_AVX512 bool avx512_contains(const T *data, unsigned long n, T key) {
+  typedef avx512_ops<T> ops;
+  const unsigned long w = ops::width;
+  typename ops::vec k = ops::set1(key);
+  unsigned long i = 0;
+  for (; i + 4*w <= n; i += 4*w) {
+    unsigned hit = ops::eq(ops::load(data + i), k) | ops::eq(ops::load(data + i + w), k) |
+                   ops::eq(ops::load(data + i + 2*w), k) | ops::eq(ops::load(data + i + 3*w), k);
+    if (hit) return true;
+  }
+  for (; i + w <= n; i += w) {
+    if (ops::eq(ops::load(data + i), k)) return true;
+  }
+  return scalar_contains(data + i, n - i, key);
+}
+
+template<typename T>
+LST_AVX512 unsigned long avx512_partition(const T *src, unsigned long n, T p, T *lesser,
+                                          T *greater, bool &toggle, T &lesser_max) {
+  typedef avx512_ops<T> ops;
+  const unsigned long w = ops::width;
+  const unsigned all = (1u << w) - 1;
+  typename ops::vec pv = ops::set1(p), vmax = ops::set1(simd_lowest<T>());
+  unsigned long n_lesser = 0, n_greater = 0, i = 0;
+  T smax = simd_lowest<T>();
+  for (; i + w <= n; i += w) {
+    typename ops::vec x = ops::load(src + i);
+    typename ops::mask lm = ops::lt(x, pv), gm = ops::lt(pv, x);
+    if ((unsigned)(lm | gm) != all) {
+      // an element equals the pivot; keep the alternation in element order.
+      scalar_partition(src + i, w, p, lesser, n_lesser, greater, n_greater, toggle, smax);
+      continue;
+    }
+    ops::compress_store(lesser + n_lesser, x, lm);
+    ops::compress_store(greater + n_greater, x, gm);
+    n_lesser += __builtin_popcount(lm);
+    n_greater += __builtin_popcount(gm);
+    vmax = ops::max(vmax, lm, x);
+  }
+  scalar_partition(src + i, n - i, p, lesser, n_lesser, greater, n_greater, toggle, smax);
+  T lanes[ops::width];
+  std::memcpy(lanes, &vmax, sizeof(lanes));
+  for (unsigned long j = 0; j < w; ++j) {
+    if (smax < lanes[j]) smax = lanes[j];
+  }
+  lesser_max = smax;
+  return n_lesser;
+}
+
+#endif // LST_SIMD_X86
+
+template<typename T, typename Comp>
+bool simd_contains_dispatch(const T *data, unsigned long n, const T &key, const Comp &comp,
+                            std::false_type) {
+  return scalar_contains(data, n, key, comp);
+}
+
+template<typename T, typename Comp>
+bool simd_contains_dispatch(const T *data, unsigned long n, const T &key, const Comp&,
+                            std::true_type) {
+#ifdef LST_SIMD_X86
+  switch (active_simd_level()) {
+    case simd_avx512: return avx512_contains(data, n, key);
+    case simd_avx2: return avx2_contains(data, n, key);
+    default: break;
+  }
+#endif
+  return scalar_contains(data, n, key);
+}
+
+template<typename T, typename Comp>
+unsigned long simd_partition_dispatch(const T *src, unsigned long n, const T &p, T *lesser,
+                                      T *greater, bool &toggle, T &lesser_max, const Comp &comp,
+                                      std::false_type) {
+  unsigned long n_lesser = 0, n_greater = 0;
+  scalar_partition(src, n, p, lesser, n_lesser, greater, n_greater, toggle, lesser_max, comp);
+  return n_lesser;
+}
+
+template<typename T, typename Comp>
+unsigned long simd_partition_dispatch(const T *src, unsigned long n, const T &p, T *lesser,
+                                      T *greater, bool &toggle, T &lesser_max, const Comp&,
+                                      std::true_type) {
+#ifdef LST_SIMD_X86
+  switch (active_simd_level()) {
+    case simd_avx512: return avx512_partition(src, n, p, lesser, greater, toggle, lesser_max);
+    case simd_avx2: return avx2_partition(src, n, p, lesser, greater, toggle, lesser_max);
+    default: break;
+  }
+#endif
+  unsigned long n_lesser = 0, n_greater = 0;
+  scalar_partition(src, n, p, lesser, n_lesser, greater, n_greater, toggle, lesser_max);
+  return n_lesser;
+}
+
+// return whether an element equal to key under comp occurs in data[0, n).
+template<typename T, typename Comp = std::less<T>>
+bool simd_contains(const T *data, unsigned long n, const T &key, const Comp &comp = Comp()) {
+  return simd_contains_dispatch<T, Comp>(data, n, key, comp, simd_enabled<T, Comp>());
+}
+
+// partition src[0, n) around p into lesser and greater as scalar_partition does, both starting
+// empty, and return the number of elements written to lesser. If that is nonzero, lesser_max is
+// set to their maximum. Both outputs need simd_slack elements of room past the end when the
+// kernels are vectorized.
+template<typename T, typename Comp = std::less<T>>
+unsigned long simd_partition(const T *src, unsigned long n, const T &p, T *lesser, T *greater,
+                             bool &toggle, T &lesser_max, const Comp &comp = Comp()) {
+  return simd_partition_dispatch<T, Comp>(src, n, p, lesser, greater, toggle, lesser_max, comp,
+                                          simd_enabled<T, Comp>());
+}
+
+#endif // SIMD_KERNELS
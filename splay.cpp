@@ -1,30 +1,182 @@
 // Taken from wikipedia: https://en.wikipedia.org/wiki/Splay_tree
-// Leaks memory. Never calls delete despite using new.
+// Nodes are obtained from Alloc, by default a pool_allocator, so they live in contiguous blocks
+// that are released in bulk when the tree is destroyed. split and join relink subtrees between
+// trees, which needs an Alloc whose pools can share their blocks, as pool_allocator's can.
+
+// Each node also stores the total Weight of the keys in its subtree, which supports order
+// statistics: with the default unit_weight these are ranks, but a key may stand for any number of
+// positions, such as a gap of a lazy search tree standing for its elements. Anything that changes
+// the weight of a key in place must call refresh on it.
 
 #ifndef SPLAY_TREE
 #define SPLAY_TREE
 
+#include "pool-allocator.cpp"
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// gives every key a weight of one.
+struct unit_weight {
+  template<typename T>
+  unsigned long operator()( const T& ) const { return 1; }
+};
 
-template<typename T, typename Comp = std::less<T>>
+template<typename T, typename Comp = std::less<T>, typename Alloc = pool_allocator<T>,
+         typename Weight = unit_weight>
 class splay_tree {
 private:
   Comp comp;
+  Weight weight;
   unsigned long p_size;
+  unsigned long n_rotations = 0;  // only counted when compiled with LST_STATS.
 
   struct node {
     node *left, *right;
     node *parent;
+    unsigned long weight, subtree_weight;
+    unsigned long subtree_size;  // the number of nodes in the subtree, so split can count them.
+    unsigned long stale;  // one past the node's index in stale_nodes, or 0 if its weight is current.
     T key;
-    node( const T& init = T( ) ) : left( nullptr ), right( nullptr ), parent( nullptr ), key( init ) { }
+    // constructs the key in place from args.
+    template<typename... Args>
+    explicit node( Args&&... args ) : left( nullptr ), right( nullptr ), parent( nullptr ),
+                                      weight( 0 ), subtree_weight( 0 ), subtree_size( 1 ),
+                                      stale( 0 ), key( std::forward<Args>( args )... ) { }
     ~node( ) {
 
     }
   } *root;
+  
+  // nodes whose weight has changed since the subtree weights were last brought up to date, so that
+  // refresh is O(1) and the cost of updating the weights is only paid by order statistics. Once
+  // there are more of them than nodes, all weights are recomputed instead.
+  std::vector<node*> stale_nodes;
+  bool all_stale;
+  
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node> node_allocator;
+  typedef std::allocator_traits<node_allocator> node_traits;
+  node_allocator alloc;
+  
+  template<typename... Args>
+  node* create_node( Args&&... args ) {
+    node *z = node_traits::allocate( alloc, 1 );
+    node_traits::construct( alloc, z, std::forward<Args>( args )... );
+    return z;
+  }
+  
+  void destroy_node( node *z ) {
+    node_traits::destroy( alloc, z );
+    node_traits::deallocate( alloc, z, 1 );
+  }
+  
+  // destroys the nodes of the subtree rooted at z, which must have no parent, without recursion.
+  void destroy_subtree( node *z ) {
+    while( z ) {
+      if( z->left ) z = z->left;
+      else if( z->right ) z = z->right;
+      else {
+        node *p = z->parent;
+        if( p ) {
+          if( p->left == z ) p->left = nullptr;
+          else p->right = nullptr;
+        }
+        destroy_node( z );
+        z = p;
+      }
+    }
+  }
+  
+  // copies the shape and keys of other, again without recursion.
+  void copy_from( const splay_tree &other ) {
+    if( !other.root ) return;
+    root = create_node( other.root->key );
+    root->weight = other.root->weight;
+    root->subtree_weight = other.root->subtree_weight;
+    root->subtree_size = other.root->subtree_size;
+    const node *s = other.root;
+    node *d = root;
+    while( s ) {
+      if( s->left && !d->left ) {
+        d->left = create_node( s->left->key );
+        d->left->parent = d;
+        s = s->left;
+        d = d->left;
+        d->weight = s->weight;
+        d->subtree_weight = s->subtree_weight;
+        d->subtree_size = s->subtree_size;
+      } else if( s->right && !d->right ) {
+        d->right = create_node( s->right->key );
+        d->right->parent = d;
+        s = s->right;
+        d = d->right;
+        d->weight = s->weight;
+        d->subtree_weight = s->subtree_weight;
+        d->subtree_size = s->subtree_size;
+      } else {
+        s = s->parent;
+        d = d->parent;
+      }
+    }
+    p_size = other.p_size;
+    all_stale = other.all_stale || !other.stale_nodes.empty( );
+  }
+  
+  static unsigned long subtree_weight( const node *u ) { return u ? u->subtree_weight : 0; }
+  static unsigned long subtree_size( const node *u ) { return u ? u->subtree_size : 0; }
+  
+  void update( node *u ) {
+    u->subtree_weight = u->weight + subtree_weight( u->left ) + subtree_weight( u->right );
+    u->subtree_size = 1 + subtree_size( u->left ) + subtree_size( u->right );
+  }
+  
+  // recompute the subtree weights of u and all of its ancestors.
+  void update_path( node *u ) {
+    for( ; u; u = u->parent ) update( u );
+  }
+  
+  // bring the subtree weights up to date with the weights of the stale nodes: along the path to
+  // the root of each, or over the whole tree, bottom-up and without recursion, if all are stale.
+  void update_weights( ) {
+    if( all_stale ) {
+      node *z = root, *prev = nullptr;
+      while( z ) {
+        node *next = nullptr;
+        if( prev == z->parent ) next = z->left ? z->left : z->right;
+        else if( prev == z->left ) next = z->right;
+        if( next ) {
+          prev = z;
+          z = next;
+        } else {
+          z->weight = weight( z->key );
+          z->stale = 0;
+          update( z );
+          prev = z;
+          z = z->parent;
+        }
+      }
+      all_stale = false;
+      stale_nodes.clear( );
+      return;
+    }
+    for( node *z : stale_nodes ) {
+      if( !z ) continue;
+      unsigned long w = weight( z->key );
+      unsigned long delta = w - z->weight;  // may wrap around, which adds correctly.
+      z->weight = w;
+      z->stale = 0;
+      for( ; z; z = z->parent ) z->subtree_weight += delta;
+    }
+    stale_nodes.clear( );
+  }
 
   // these two functions should be replacable with a single rotate-with-parent function
   void left_rotate( node *x ) {
+#ifdef LST_STATS
+    ++n_rotations;
+#endif
     node *y = x->right;
     if(y) {
       x->right = y->left;
@@ -37,9 +189,14 @@ private:
     else x->parent->right = y;
     if(y) y->left = x;
     x->parent = y;
+    update( x );
+    if(y) update( y );
   }
 
   void right_rotate( node *x ) {
+#ifdef LST_STATS
+    ++n_rotations;
+#endif
     node *y = x->left;
     if(y) {
       x->left = y->right;
@@ -51,6 +208,8 @@ private:
     else x->parent->right = y;
     if(y) y->right = x;
     x->parent = y;
+    update( x );
+    if(y) update( y );
   }
 
   void splay( node *x ) {
@@ -81,24 +240,58 @@ private:
     if( v ) v->parent = u->parent;
   }
 
-  node* subtree_minimum( node *u ) {
+  static node* subtree_minimum( node *u ) {
     while( u->left ) u = u->left;
     return u;
   }
 
-  node* subtree_maximum( node *u ) {
+  static node* subtree_maximum( node *u ) {
     while( u->right ) u = u->right;
     return u;
   }
   
+  // returns the next node in sorted order, or null if u is the last.
+  static node* successor( node *u ) {
+    if( u->right ) return subtree_minimum( u->right );
+    node *p = u->parent;
+    while( p && u == p->right ) {
+      u = p;
+      p = p->parent;
+    }
+    return p;
+  }
+  
+  // returns the previous node in sorted order, or null if u is the first.
+  static node* predecessor( node *u ) {
+    if( u->left ) return subtree_maximum( u->left );
+    node *p = u->parent;
+    while( p && u == p->left ) {
+      u = p;
+      p = p->parent;
+    }
+    return p;
+  }
+  
   // returns the smallest node that compares >= key, or the largest node
-  // if no larger node exists. Returns null on an empty tree.
-  node* find_or_successor(const T &key) {
+  // if no larger node exists, without splaying it. Returns null on an empty tree. K may be any
+  // type that Comp can compare against T, which lets callers search without building a T.
+  template<typename K>
+  node* search(const K &key) const {
+    node *last;
+    unsigned long depth;
+    return search(key, last, depth);
+  }
+  
+  // as above, also setting last to the last node visited and depth to the number of nodes visited.
+  template<typename K>
+  node* search(const K &key, node *&last, unsigned long &depth) const {
     node *z = root;
-    node *last = nullptr;
     node *ret = nullptr;
+    last = nullptr;
+    depth = 0;
     while (z) {
       last = z;
+      ++depth;
       if (comp(z->key, key)) z = z->right;
       else if (comp(key, z->key)) {
         ret = z;  // update successor
@@ -109,13 +302,21 @@ private:
       }
     }
     if (!ret) { ret = last; }
-    if (!ret) { splay(ret); }
+    return ret;
+  }
+  
+  // as search, but splays the node found to the root.
+  template<typename K>
+  node* find_or_successor(const K &key) {
+    node *ret = search(key);
+    if (ret) { splay(ret); }
     return ret;
   }
   
   // returns the node containing key, if such a node exists, and returns
   // null otherwise.
-  node* find(const T &key) {
+  template<typename K>
+  node* find(const K &key) {
     node* z = find_or_successor(key);
     if (!z || comp(z->key, key) || comp(key, z->key)) z = nullptr;
     return z;
@@ -128,39 +329,134 @@ private:
     print_tree(node->right);
   }
   
-public:
-  splay_tree( ) : root( nullptr ), p_size( 0 ) { }
-
-  void insert( const T &key ) {
+  // links the new node x into the tree below its position and splays it to the root.
+  void insert_node( node *x ) {
     node *z = root;
     node *p = nullptr;
 
     while( z ) {
       p = z;
-      if( comp( z->key, key ) ) z = z->right;
+      if( comp( z->key, x->key ) ) z = z->right;
       else z = z->left;
     }
 
-    z = new node( key );
-    z->parent = p;
+    x->weight = weight( x->key );
+    x->parent = p;
 
-    if( !p ) root = z;
-    else if( comp( p->key, z->key ) ) p->right = z;
-    else p->left = z;
+    if( !p ) root = x;
+    else if( comp( p->key, x->key ) ) p->right = x;
+    else p->left = x;
 
-    splay( z );
+    update_path( x );
+    splay( x );
     p_size++;
   }
+  
+public:
+  // a bidirectional iterator over the keys in sorted order. Stays valid until its node is erased.
+  class iterator {
+  private:
+    node *z;
+    friend class splay_tree;
+    explicit iterator( node *z ) : z( z ) { }
+  public:
+    iterator( ) : z( nullptr ) { }
+    T& operator*( ) const { return z->key; }
+    T* operator->( ) const { return &z->key; }
+    iterator& operator++( ) { z = successor( z ); return *this; }
+    iterator& operator--( ) { z = predecessor( z ); return *this; }
+    bool operator==( const iterator &other ) const { return z == other.z; }
+    bool operator!=( const iterator &other ) const { return z != other.z; }
+  };
+
+  splay_tree( ) : p_size( 0 ), root( nullptr ), all_stale( false ) { }
+  
+  // orders the keys by comp.
+  explicit splay_tree( const Comp &comp ) : comp( comp ), p_size( 0 ), root( nullptr ),
+                                            all_stale( false ) { }
+  
+  splay_tree( const splay_tree &other ) : comp( other.comp ), weight( other.weight ), p_size( 0 ),
+                                          root( nullptr ), all_stale( false ) {
+    copy_from( other );
+  }
+  
+  splay_tree( splay_tree &&other ) : comp( std::move( other.comp ) ),
+                                     weight( std::move( other.weight ) ), p_size( other.p_size ),
+                                     root( other.root ),
+                                     stale_nodes( std::move( other.stale_nodes ) ),
+                                     all_stale( other.all_stale ),
+                                     alloc( std::move( other.alloc ) ) {
+    other.root = nullptr;
+    other.p_size = 0;
+    other.stale_nodes.clear( );
+    other.all_stale = false;
+  }
+  
+  splay_tree& operator=( const splay_tree &other ) {
+    if( this != &other ) {
+      clear( );
+      comp = other.comp;
+      copy_from( other );
+    }
+    return *this;
+  }
+  
+  splay_tree& operator=( splay_tree &&other ) {
+    if( this != &other ) {
+      clear( );
+      comp = std::move( other.comp );
+      alloc = std::move( other.alloc );
+      root = other.root;
+      p_size = other.p_size;
+      stale_nodes.swap( other.stale_nodes );
+      all_stale = other.all_stale;
+      other.root = nullptr;
+      other.p_size = 0;
+      other.all_stale = false;
+    }
+    return *this;
+  }
+  
+  ~splay_tree( ) { clear( ); }
+  
+  // destroys every node without recursion, since a splay tree may be a path.
+  void clear( ) {
+    destroy_subtree( root );
+    root = nullptr;
+    stale_nodes.clear( );
+    all_stale = false;
+    p_size = 0;
+  }
+  
+  void insert( const T &key ) { insert_node( create_node( key ) ); }
+  
+  // moves key into the tree rather than copying it.
+  void insert( T &&key ) { insert_node( create_node( std::move( key ) ) ); }
+  
+  // constructs the key in place from args.
+  template<typename... Args>
+  void emplace( Args&&... args ) { insert_node( create_node( std::forward<Args>( args )... ) ); }
 
   void erase( const T &key ) {
     node *z = find( key );
     if( !z ) return;
+    erase( iterator( z ) );
+  }
 
+  // removes the key at it without searching for it. Other iterators stay valid.
+  void erase( iterator it ) {
+    node *z = it.z;
+    if( z->stale && !all_stale ) stale_nodes[z->stale - 1] = nullptr;
+
+    // the lowest node whose subtree changes.
+    node *fix = z->parent;
     if( !z->left ) replace( z, z->right );
     else if( !z->right ) replace( z, z->left );
     else {
       node *y = subtree_minimum( z->right );
+      fix = y;
       if( y->parent != z ) {
+        fix = y->parent;
         replace( y, y->right );
         y->right = z->right;
         y->right->parent = y;
@@ -169,8 +465,9 @@ public:
       y->left = z->left;
       y->left->parent = y;
     }
+    update_path( fix );
 
-    delete z;
+    destroy_node( z );
     p_size--;
   }
 
@@ -183,7 +480,8 @@ public:
   
   // returns the smallest key that compares >= key, or the largest node
   // if no other node exists. Bad things happen if the tree is empty.
-  T& lower_bound_or_last(const T &key) {
+  template<typename K>
+  T& lower_bound_or_last(const K &key) {
     node *ret = find_or_successor(key);
     return ret->key;
   }
@@ -196,9 +494,126 @@ public:
   const T& minimum( ) { return subtree_minimum( root )->key; }
   const T& maximum( ) { return subtree_maximum( root )->key; }
 
+  iterator begin( ) { return iterator( root ? subtree_minimum( root ) : nullptr ); }
+  iterator end( ) { return iterator( ); }
+  
+  // returns an iterator to the smallest key that compares >= key, or to the largest key
+  // if no larger key exists. Returns end() on an empty tree.
+  template<typename K>
+  iterator locate( const K &key ) { return iterator( find_or_successor( key ) ); }
+  
+  // as locate, but only splays when the search visits more than three times log2 n nodes, and
+  // then splays the last node visited. Lookups spread over the tree then leave it as it is, while
+  // a long path left by skewed accesses is still splayed away, so the cost stays amortized
+  // O(log n) without paying for rotations on every lookup.
+  template<typename K>
+  iterator locate_bounded( const K &key ) {
+    node *last;
+    unsigned long depth;
+    node *z = search( key, last, depth );
+    if( depth > 3ul * ( 64 - __builtin_clzl( p_size | 1 ) ) ) splay( last );
+    return iterator( z );
+  }
+  
+  // must be called after the weight of *it changes in place. Keys may only be modified in ways
+  // that keep them in order.
+  // O(1): the subtree weights are brought up to date by the next order statistic.
+  void refresh( iterator it ) {
+    node *z = it.z;
+    if( all_stale || z->stale ) return;
+    if( stale_nodes.size( ) >= p_size ) {
+      all_stale = true;
+      stale_nodes.clear( );
+      return;
+    }
+    stale_nodes.push_back( z );
+    z->stale = stale_nodes.size( );
+  }
+  
+  // returns an iterator to the key covering position k, when the keys are laid out in sorted
+  // order and each occupies Weight(key) positions, and reduces k to the position within that key.
+  // Returns end() if k is at least the total weight.
+  iterator select( unsigned long &k ) {
+    update_weights( );
+    node *z = root;
+    while( z ) {
+      unsigned long left = subtree_weight( z->left );
+      if( k < left ) {
+        z = z->left;
+      } else {
+        k -= left;
+        if( k < z->weight ) break;
+        k -= z->weight;
+        z = z->right;
+      }
+    }
+    return iterator( z );
+  }
+  
+  // returns the total weight of the keys before *it.
+  unsigned long weight_before( iterator it ) {
+    update_weights( );
+    node *z = it.z;
+    unsigned long total = subtree_weight( z->left );
+    for( ; z->parent; z = z->parent ) {
+      if( z == z->parent->right ) total += subtree_weight( z->parent->left ) + z->parent->weight;
+    }
+    return total;
+  }
+  
+  // returns the total weight of all keys.
+  unsigned long total_weight( ) {
+    update_weights( );
+    return subtree_weight( root );
+  }
+  
+  // moves every key that compares >= key into right, which must be empty. The nodes are relinked
+  // rather than rebuilt, and right shares this tree's pool from then on. Amortized O(log n).
+  template<typename K>
+  void split( const K &key, splay_tree &right ) {
+    node *z = find_or_successor( key );
+    if( !z || comp( z->key, key ) ) return;
+    update_weights( );
+    root = z->left;
+    if( root ) root->parent = nullptr;
+    z->left = nullptr;
+    update( z );
+    right.alloc.share( alloc );
+    right.root = z;
+    right.p_size = z->subtree_size;
+    p_size -= z->subtree_size;
+  }
+  
+  // moves every key of right, which must all be larger than the keys of this tree, to the end of
+  // this tree, leaving right empty. The nodes are relinked, taking over right's pool along with
+  // them. Amortized O(log n).
+  void join( splay_tree &right ) {
+    if( !right.root ) return;
+    update_weights( );
+    right.update_weights( );
+    alloc.absorb( right.alloc );
+    node *r = right.root;
+    unsigned long moved = right.p_size;
+    right.root = nullptr;
+    right.p_size = 0;
+    if( !root ) {
+      root = r;
+    } else {
+      node *z = subtree_maximum( root );
+      splay( z );
+      z->right = r;
+      r->parent = z;
+      update( z );
+    }
+    p_size += moved;
+  }
+  
   bool empty( ) const { return root == nullptr; }
   unsigned long size( ) const { return p_size; }
   
+  // returns the number of rotations done so far, or 0 unless compiled with LST_STATS.
+  unsigned long rotations( ) const { return n_rotations; }
+  
   void print() {
     if (!empty()) {
       print_tree(root);
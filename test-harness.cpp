@@ -1,5 +1,7 @@
 #include "splay.cpp"
 #include "lazy-search-tree.cpp"
+#include "lazy-search-map.cpp"
+#include "concurrent-lazy-search-tree.cpp"
 #include <queue>
 #include <iostream>
 #include <vector>
@@ -7,35 +9,523 @@
 #include <algorithm>
 #include <random>
 #include <chrono>
+#include <map>
+#include <string>
+#include <thread>
 
 using namespace std;
 
-// tests for correctness of LST
-void correctness() {
+// keys of the correctness tests are drawn from [0, key_range).
+const int key_range = 20000;
+
+// report a failed check of the correctness tests.
+void expect(bool ok, const string &what, long item) {
+  if (!ok) cerr << "Error!: " << what << " " << item << endl;
+}
+
+// the reference model loop of the correctness tests: drives lst and bst, a set holding the same
+// keys, through steps random steps over the keys first + [0, key_range), drawn from a generator
+// seeded with seed. Each step either inserts a key that neither holds yet or passes the key to
+// check, which runs one operation on both and compares the results.
+template <typename Tree, typename Check>
+void against_set(Tree &lst, set<int> &bst, int steps, Check check, int first = 0,
+                 unsigned seed = rand()) {
+  mt19937 gen(seed);
+  for (int i = 0; i < steps; ++i) {
+    int item = first + (int)(gen() % key_range);
+    if (gen() % 2) {
+      if (bst.insert(item).second) lst.insert(item);
+    } else {
+      check(item);
+    }
+  }
+}
+
+// compare the size of lst, and the membership of every key in [0, last), against bst.
+template <typename Tree>
+void matches_set(Tree &lst, const set<int> &bst, const string &what, int last = key_range) {
+  expect(lst.size() == bst.size(), what + ": size", lst.size());
+  for (int item = 0; item < last; ++item) {
+    expect((bool)lst.count(item) == (bool)bst.count(item), what + ": count", item);
+  }
+}
+
+// inserts and count against set.
+template <typename Tree>
+void count_correctness(Tree &lst, const string &what) {
+  set<int> bst;
+  against_set(lst, bst, 20000, [&](int item) {
+    expect((bool)lst.count(item) == (bool)bst.count(item), what + ": count", item);
+  });
+  matches_set(lst, bst, what);
+}
+
+// insert_bulk and assign against set: bulk loads into an empty tree, which takes the keys over as
+// one gap, and into a tree already split into gaps by queries, which buckets them by gap.
+void bulk_correctness() {
   lazy_search_tree<int> lst;
   set<int> bst;
-  
-  for (int i = 0; i < 10000; ++i) {
-    int item = rand() % 20000;
-    if (rand()%2) {
-      if (bst.count(item) == 0) {
-        cout << "Insert " << item << endl;
-        lst.insert(item);
-        bst.insert(item);
+  for (int round = 0; round < 40; ++round) {
+    vector<int> keys;
+    for (int j = 0; j < 500; ++j) {
+      int item = rand() % key_range;
+      if (bst.insert(item).second) keys.push_back(item);
+    }
+    if (round % 10 == 0) {
+      vector<int> all(bst.begin(), bst.end());
+      shuffle(all.begin(), all.end(), default_random_engine(round));
+      lst.assign(all.begin(), all.end());
+    } else {
+      lst.insert_bulk(std::move(keys));
+    }
+    against_set(lst, bst, 200, [&](int item) {
+      expect((bool)lst.count(item) == (bool)bst.count(item), "count after insert_bulk", item);
+    });
+  }
+  matches_set(lst, bst, "insert_bulk");
+}
+
+// count_batch against set, on batches of 64 keys clustered near a random key.
+void batch_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  int keys[64];
+  bool found[64];
+  for (int j = 0; j < 64; ++j) keys[j] = j;
+  lst.count_batch(keys, 64, found);
+  expect(count(found, found + 64, true) == 0, "count_batch on an empty tree", 0);
+  against_set(lst, bst, 4000, [&](int item) {
+    for (int j = 0; j < 64; ++j) keys[j] = (item + rand() % 256) % key_range;
+    lst.count_batch(keys, 64, found);
+    for (int j = 0; j < 64; ++j) {
+      expect(found[j] == (bst.count(keys[j]) == 1), "count_batch", keys[j]);
+    }
+  });
+  matches_set(lst, bst, "count_batch");
+}
+
+// rank and select against the positions of keys in set, interleaved with bulk loads into the
+// populated tree.
+template <typename Tree>
+void rank_select_correctness(Tree &lst, const string &what) {
+  set<int> bst;
+  against_set(lst, bst, 8000, [&](int item) {
+    int op = rand() % 3;
+    if (op == 0) {
+      unsigned long below = distance(bst.begin(), bst.lower_bound(item));
+      expect(lst.rank(item) == below, what + ": rank", item);
+    } else if (op == 1) {
+      if (bst.empty()) return;
+      unsigned long k = item % bst.size();
+      expect(lst.select(k) == *next(bst.begin(), k), what + ": select", k);
+    } else {
+      vector<int> keys;
+      for (int j = item; j < min(item + 64, key_range); j += 1 + rand() % 4) {
+        if (bst.insert(j).second) keys.push_back(j);
       }
+      lst.insert_bulk(std::move(keys));
+    }
+  });
+  matches_set(lst, bst, what);
+}
+
+// top and pop against the minimum of set, interleaved with inserts that may land below elements
+// already popped.
+void top_pop_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  against_set(lst, bst, 20000, [&](int item) {
+    if (bst.empty() || rand() % 2) {
+      expect((bool)lst.count(item) == (bool)bst.count(item), "count between pops", item);
+      return;
+    }
+    expect(lst.top() == *bst.begin(), "top", *bst.begin());
+    lst.pop();
+    bst.erase(bst.begin());
+  });
+  matches_set(lst, bst, "top and pop");
+}
+
+// erase and erase_range against set, over ranges of up to 200 keys.
+template <typename Tree>
+void erase_correctness(Tree &lst, const string &what) {
+  set<int> bst;
+  against_set(lst, bst, 20000, [&](int lo) {
+    int op = rand() % 4;
+    if (op < 2) {
+      expect((bool)lst.count(lo) == (bool)bst.count(lo), what + ": count", lo);
+    } else if (op == 2) {
+      expect(lst.erase(lo) == bst.erase(lo), what + ": erase", lo);
     } else {
-      cout << "Check " << item << endl;
-      bool LST_in = lst.count(item);
-      bool BST_in = bst.count(item);
-      
-      cerr << "LST: " << LST_in << ", BST: " << BST_in << endl;
-      if (LST_in != BST_in) {
-        lst.print();
-        cerr << lst.count(item);
-        cerr << "Error!: " << item << endl;
+      int hi = lo + rand() % 200;
+      unsigned long in_range = distance(bst.lower_bound(lo), bst.lower_bound(hi));
+      expect(lst.erase_range(lo, hi) == in_range, what + ": erase_range", lo);
+      bst.erase(bst.lower_bound(lo), bst.lower_bound(hi));
+    }
+  });
+  matches_set(lst, bst, what);
+}
+
+// the concurrent tree against set: each thread inserts, erases and counts the keys of its own
+// range against a set of its own while the shards split, merge and are refined in the background.
+void concurrent_correctness() {
+  const int n_threads = 4;
+  concurrent_lazy_search_tree<int> lst(4, 256);
+  lst.start_refining(1 << 10, chrono::milliseconds(1));
+  vector<set<int>> owned(n_threads);
+  vector<thread> threads;
+  for (int id = 0; id < n_threads; ++id) {
+    threads.emplace_back([&lst, &owned, id] {
+      mt19937 gen(id);
+      against_set(lst, owned[id], 20000, [&](int item) {
+        if (gen() % 2) {
+          expect(lst.erase(item) == owned[id].erase(item), "concurrent erase", item);
+        } else {
+          expect((bool)lst.count(item) == (bool)owned[id].count(item), "concurrent count", item);
+        }
+      }, id * key_range, id);
+    });
+  }
+  for (thread &t : threads) t.join();
+  lst.stop_refining();
+  set<int> bst;
+  for (const set<int> &s : owned) bst.insert(s.begin(), s.end());
+  matches_set(lst, bst, "concurrent", n_threads * key_range);
+}
+
+// extract and extract_range against set: the elements handed back must be those the set removes.
+void extract_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  vector<int> out;
+  against_set(lst, bst, 20000, [&](int lo) {
+    int hi = rand() % 2 ? lo + 1 : lo + rand() % 200;
+    vector<int> removed(bst.lower_bound(lo), bst.lower_bound(hi));
+    bst.erase(bst.lower_bound(lo), bst.lower_bound(hi));
+    out.clear();
+    if (hi == lo + 1) {
+      expect(lst.extract(lo, out) == removed.size(), "extract", lo);
+    } else {
+      expect(lst.extract_range(lo, hi, out) == removed.size(), "extract_range", lo);
+    }
+    sort(out.begin(), out.end());
+    expect(out == removed, "extracted elements", lo);
+  });
+  matches_set(lst, bst, "extract");
+}
+
+// pivoting in parallel against set: the threshold is low enough that the large intervals of a tree
+// filled before its first query are pivoted by the workers.
+void parallel_correctness() {
+  thread_pool pool(4);
+  lazy_search_tree<int> lst;
+  lst.set_thread_pool(&pool, 256);
+  set<int> bst;
+  for (int j = 0; j < key_range / 2; ++j) {
+    int item = rand() % key_range;
+    if (bst.insert(item).second) lst.insert(item);
+  }
+  against_set(lst, bst, 20000, [&](int item) {
+    expect((bool)lst.count(item) == (bool)bst.count(item), "parallel count", item);
+  });
+  matches_set(lst, bst, "parallel pivots");
+}
+
+// refine and refine_for against set: queries must still match after restructuring done ahead of
+// them, interleaved with inserts and erases.
+void refine_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  against_set(lst, bst, 20000, [&](int item) {
+    int op = rand() % 4;
+    if (op == 0) {
+      lst.refine(rand() % 4096);
+    } else if (op == 1) {
+      lst.refine_for(chrono::microseconds(rand() % 100));
+    } else if (op == 2) {
+      expect(lst.erase(item) == bst.erase(item), "erase after refine", item);
+    } else {
+      expect((bool)lst.count(item) == (bool)bst.count(item), "count after refine", item);
+    }
+  });
+  matches_set(lst, bst, "refine");
+}
+
+// lazy_search_map against map: insert_or_assign, find and erase on the same keys, holding a value
+// pointer from find across all of them.
+void map_correctness() {
+  lazy_search_map<int, int> lsm;
+  map<int, int> m;
+  lsm.insert(-1, -1);
+  m[-1] = -1;
+  int *held = lsm.find(-1);
+  for (int i = 0; i < 20000; ++i) {
+    int key = rand() % key_range;
+    int op = rand() % 3;
+    if (op == 0) {
+      expect(lsm.insert_or_assign(key, i) == (m.count(key) == 0), "map insert_or_assign", key);
+      m[key] = i;
+    } else if (op == 1) {
+      int *v = lsm.find(key);
+      auto it = m.find(key);
+      expect((v == nullptr) == (it == m.end()) && (!v || *v == it->second), "map find", key);
+    } else {
+      expect(lsm.erase(key) == m.erase(key), "map erase", key);
+    }
+  }
+  expect(lsm.find(-1) == held && *held == -1, "map value moved", -1);
+  expect(lsm.size() == m.size(), "map size", lsm.size());
+}
+
+// a comparator with state: orders by the residue mod m, then by value.
+struct mod_order {
+  int m;
+  bool operator()(int a, int b) const { return a % m != b % m ? a % m < b % m : a < b; }
+};
+
+// orderings other than less, through Comp: trees ordered by greater, over both gap indexes, a tree
+// of strings, and trees whose comparator holds state, against sets ordered the same way. select(k)
+// and iteration must follow that order too.
+void comparator_correctness() {
+  lazy_search_tree<int, greater<int>> desc;
+  lazy_search_tree<int, greater<int>, flat_index> desc_flat;
+  lazy_search_tree<string> words;
+  lazy_search_tree<int, mod_order> mod(mod_order{7});
+  lazy_search_tree<int, mod_order, flat_index> mod_flat(mod_order{7});
+  set<int, greater<int>> desc_bst;
+  set<string> words_bst;
+  set<int, mod_order> mod_bst(mod_order{7});
+  for (int i = 0; i < 20000; ++i) {
+    int item = rand() % key_range;
+    string word = to_string(item);
+    if (rand() % 2) {
+      if (desc_bst.insert(item).second) {
+        desc.insert(item);
+        desc_flat.insert(item);
+      }
+      if (words_bst.insert(word).second) words.insert(word);
+      if (mod_bst.insert(item).second) {
+        mod.insert(item);
+        mod_flat.insert(item);
       }
+      continue;
     }
+    expect((bool)desc.count(item) == (bool)desc_bst.count(item), "count with greater", item);
+    expect((bool)desc_flat.count(item) == (bool)desc_bst.count(item),
+           "count with greater, flat_index", item);
+    expect((bool)words.count(word) == (bool)words_bst.count(word), "count of strings", item);
+    expect((bool)mod.count(item) == (bool)mod_bst.count(item), "count with mod_order", item);
+    expect((bool)mod_flat.count(item) == (bool)mod_bst.count(item),
+           "count with mod_order, flat_index", item);
+    if (desc_bst.empty()) continue;
+    unsigned long k = item % desc_bst.size();
+    expect(desc.select(k) == *next(desc_bst.begin(), k), "select with greater", k);
+    expect(desc_flat.select(k) == *next(desc_bst.begin(), k), "select with greater, flat_index", k);
+    expect(words.select(k) == *next(words_bst.begin(), k), "select of strings", k);
+    expect(mod.select(k) == *next(mod_bst.begin(), k), "select with mod_order", k);
+    expect(mod_flat.select(k) == *next(mod_bst.begin(), k), "select with mod_order, flat_index", k);
   }
+  expect(equal(mod.begin(), mod.end(), mod_bst.begin(), mod_bst.end()),
+         "iteration with mod_order", mod_bst.size());
+  expect(equal(mod_flat.begin(), mod_flat.end(), mod_bst.begin(), mod_bst.end()),
+         "iteration with mod_order, flat_index", mod_bst.size());
+}
+
+// stats against the tree as it is queried and erased from: the size, the number of intervals the
+// histogram counts and the largest interval must agree with the tree and with each other.
+void stats_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  against_set(lst, bst, 20000, [&](int item) {
+    if (rand() % 2) {
+      expect(lst.erase(item) == bst.erase(item), "erase", item);
+    } else {
+      lst.count(item);
+    }
+    if (rand() % 64) return;
+    lst_stats s = lst.stats();
+    unsigned long histogram_total = 0;
+    int top_bucket = -1;
+    for (unsigned long i = 0; i < s.interval_sizes.size(); ++i) {
+      histogram_total += s.interval_sizes[i];
+      if (s.interval_sizes[i] > 0) top_bucket = i;
+    }
+    expect(s.size == bst.size(), "stats size", s.size);
+    expect(histogram_total == s.n_intervals, "stats interval histogram", histogram_total);
+    expect(s.n_gaps <= s.n_intervals && s.n_intervals <= s.size, "stats gaps and intervals",
+           s.n_intervals);
+    expect((s.n_gaps == 0) == bst.empty(), "stats gaps of an empty tree", s.n_gaps);
+    expect(top_bucket < 0 || (s.largest_interval >> top_bucket) == 1, "stats largest interval",
+           s.largest_interval);
+  });
+}
+
+// for_each_in_range and count_range against the same ranges of set, of up to 2000 keys.
+void range_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  vector<int> seen;
+  against_set(lst, bst, 10000, [&](int lo) {
+    int hi = lo + rand() % 2000;
+    vector<int> want(bst.lower_bound(lo), bst.lower_bound(hi));
+    if (rand() % 2) {
+      expect(lst.count_range(lo, hi) == want.size(), "count_range", lo);
+      return;
+    }
+    seen.clear();
+    lst.for_each_in_range(lo, hi, [&seen](int item) { seen.push_back(item); });
+    sort(seen.begin(), seen.end());
+    expect(seen == want, "for_each_in_range", lo);
+  });
+  matches_set(lst, bst, "ranges");
+}
+
+// iteration and lower_bound against set, interleaved with refine, inserts and erases: walks of up to
+// 20 elements from lower_bound, then a walk over the whole tree.
+void iteration_correctness() {
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  against_set(lst, bst, 10000, [&](int item) {
+    int op = rand() % 4;
+    if (op == 0) {
+      lst.refine(rand() % 4096);
+      return;
+    }
+    if (op == 1) {
+      expect(lst.erase(item) == bst.erase(item), "erase between walks", item);
+      return;
+    }
+    auto it = lst.lower_bound(item);
+    auto want = bst.lower_bound(item);
+    for (int j = 0; j < 20 && want != bst.end(); ++j, ++it, ++want) {
+      if (it == lst.end() || *it != *want) {
+        expect(false, "lower_bound walk", item);
+        return;
+      }
+    }
+    if (want == bst.end()) expect(it == lst.end(), "lower_bound walk past the end", item);
+  });
+  expect(equal(lst.begin(), lst.end(), bst.begin(), bst.end()), "iteration", lst.size());
+  matches_set(lst, bst, "iteration");
+}
+
+// split and join against set: split at a random key, compare both halves with the two sides of the
+// set, query the left half on its own and join the halves back.
+template <typename Tree>
+void split_join_correctness(Tree &lst, const string &what) {
+  set<int> bst;
+  for (int round = 0; round < 100; ++round) {
+    against_set(lst, bst, 200, [&](int item) {
+      expect((bool)lst.count(item) == (bool)bst.count(item), what + ": count", item);
+    });
+    int key = rand() % key_range;
+    Tree right;
+    lst.split(key, right);
+    expect(equal(lst.begin(), lst.end(), bst.begin(), bst.lower_bound(key)),
+           what + ": left of split", key);
+    expect(equal(right.begin(), right.end(), bst.lower_bound(key), bst.end()),
+           what + ": right of split", key);
+    int below = rand() % (key + 1);
+    expect((bool)lst.count(below) == (below < key && bst.count(below)),
+           what + ": count left of split", below);
+    lst.join(right);
+    expect(right.empty() && lst.size() == bst.size(), what + ": join", key);
+  }
+  matches_set(lst, bst, what);
+}
+
+// save and load against set. The tree is saved and loaded back from the same file each round, so
+// from the second round on it saves over the file its elements are mapped from.
+void snapshot_correctness() {
+  const string path = "test-harness.snapshot";
+  lazy_search_tree<int> lst;
+  set<int> bst;
+  for (int round = 0; round < 20; ++round) {
+    against_set(lst, bst, 1000, [&](int item) {
+      expect((bool)lst.count(item) == (bool)bst.count(item), "count of a loaded tree", item);
+    });
+    expect(lst.save(path) && lst.load(path), "save and load", round);
+    expect(lst.size() == bst.size(), "loaded size", lst.size());
+  }
+  expect(equal(lst.begin(), lst.end(), bst.begin(), bst.end()), "loaded iteration", lst.size());
+  matches_set(lst, bst, "snapshot");
+  remove(path.c_str());
+}
+
+// the vectorized kernels against the scalar ones: the same scans, partitions and tree operations
+// run at each instruction set the CPU supports, from the widest down, and must give the same
+// results. Lowers the level for the rest of the program, so it runs last.
+void simd_correctness() {
+  vector<int> data(4096);
+  for (int &item : data) item = rand() % 1000;
+  vector<long> reference;
+  for (int level = active_simd_level(); level >= simd_scalar; --level) {
+    limit_simd_level((simd_level)level);
+    vector<long> results;
+    for (unsigned long n = 0; n <= data.size(); n += 97) {
+      vector<int> lesser(n + simd_slack), greater(n + simd_slack);
+      bool toggle = false;
+      int lesser_max = 0;
+      unsigned long n_lesser = simd_partition(data.data(), n, data[n % 1000], lesser.data(),
+                                              greater.data(), toggle, lesser_max);
+      results.push_back(n_lesser);
+      if (n_lesser > 0) results.push_back(lesser_max);
+      results.insert(results.end(), lesser.begin(), lesser.begin() + n_lesser);
+      results.insert(results.end(), greater.begin(), greater.begin() + (n - n_lesser));
+      results.push_back(simd_contains(data.data(), n, (int)(n % 1000)));
+    }
+    lazy_search_tree<int> lst;
+    set<int> bst;
+    against_set(lst, bst, 20000, [&](int item) {
+      results.push_back(lst.count(item));
+      expect((bool)results.back() == (bool)bst.count(item), "count at the simd level", level);
+    }, 0, 1);
+    if (reference.empty()) reference = results;
+    expect(results == reference, "results differ from the widest simd level", level);
+  }
+}
+
+// tests for correctness of LST, each against a std::set holding the same keys.
+void correctness() {
+  lazy_search_tree<int> lst;
+  count_correctness(lst, "lst");
+  bulk_correctness();
+  batch_correctness();
+  lazy_search_tree<int> ranked;
+  rank_select_correctness(ranked, "lst");
+  top_pop_correctness();
+  lazy_search_tree<int> erased;
+  erase_correctness(erased, "lst");
+  // the flat gap index, through the same checks as the splay tree.
+  lazy_search_tree<int, less<int>, flat_index> flat, flat_ranked, flat_erased;
+  count_correctness(flat, "flat_index");
+  rank_select_correctness(flat_ranked, "flat_index");
+  erase_correctness(flat_erased, "flat_index");
+  concurrent_correctness();
+  extract_correctness();
+  parallel_correctness();
+  refine_correctness();
+  lazy_search_tree<int, less<int>, splay_tree, full_depth> full;
+  count_correctness(full, "full_depth");
+  lazy_search_tree<int, less<int>, splay_tree, adaptive_depth> adaptive;
+  count_correctness(adaptive, "adaptive_depth");
+  pivot_rule rules[] = {pivot_rule::median_of_k, pivot_rule::ninther, pivot_rule::median_of_medians};
+  for (pivot_rule rule : rules) {
+    lazy_search_tree<int> pivoted;
+    pivoted.set_pivot_rule(rule);
+    count_correctness(pivoted, "pivot rule " + to_string((int)rule));
+  }
+  map_correctness();
+  comparator_correctness();
+  stats_correctness();
+  range_correctness();
+  iteration_correctness();
+  lazy_search_tree<int> split;
+  split_join_correctness(split, "lst");
+  lazy_search_tree<int, less<int>, flat_index> flat_split;
+  split_join_correctness(flat_split, "flat_index");
+  snapshot_correctness();
+  simd_correctness();
   
 /*  for (int i = 0; i < 10000; ++i) {
     int item = rand() % 20000;
@@ -55,7 +545,7 @@ void correctness() {
 // tests for q uniformly distributed queries on n elements,
 // queries and insertions are interspersed.
 template <typename container>
-void uniform_speed(int n, int q, container c) {
+void uniform_speed(int n, int q, container &c) {
   vector<int> keys(n);
   for (int i = 0; i < n; ++i) {
     keys[i] = i;
@@ -75,7 +565,7 @@ void uniform_speed(int n, int q, container c) {
 // consecutive elements. Queries and insertions are interspersed, each batch is
 // uniformly distributed.
 template <typename container>
-void clustered_speed(int n, int q, int k, container c) {
+void clustered_speed(int n, int q, int k, container &c) {
   vector<int> keys(n);
   for (int i = 0; i < n; ++i) {
     keys[i] = i;
@@ -107,39 +597,89 @@ void clustered_speed(int n, int q, int k, container c) {
   cout << "Time: " << duration << endl;
 }
 
+// clustered_speed, but each batch of k consecutive keys is answered by a single count_batch call.
+template <typename container>
+void clustered_batch_speed(int n, int q, int k, container &c) {
+  vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  default_random_engine gen(0);
+  shuffle(keys.begin(), keys.end(), gen);
+  
+  uniform_int_distribution<int> query(0, n-1);
+  uniform_int_distribution<int> start(0, n-k);
+  vector<int> batch(k);
+  unique_ptr<bool[]> found(new bool[k]);
+  cout << "Begin test" << endl;
+  auto t1 = chrono::high_resolution_clock::now();
+  for (int i = 0; i < n; ++i) {
+    c.insert(keys[i]);
+    if (query(gen) < q/k) {
+      int st = start(gen);
+      for (int j = 0; j < k; ++j) {
+        batch[j] = st+j;
+      }
+      c.count_batch(batch.data(), k, found.get());
+    }
+  }
+  auto t2 = chrono::high_resolution_clock::now();
+  cout << "Test Complete" << endl;
+  auto duration = chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
+  cout << "Time: " << duration << endl;
+}
+
 // priority queue test of library PQ, insertions uniformly distributed, insertions
-// preceding queries.
+// preceding extractions of the q smallest elements.
 void pq_lib_speed(int n, int q) {
-  priority_queue<int> pq;
+  priority_queue<int, vector<int>, greater<int>> pq;
   vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  shuffle(keys.begin(), keys.end(), default_random_engine(0));
   cout << "Begin test" << endl;
+  auto t1 = chrono::high_resolution_clock::now();
   for (int i = 0; i < n; ++i) {
-    pq.push(i);
+    pq.push(keys[i]);
   }
   for (int i = 0; i < q; ++i) {
+    if (pq.top() != i) cerr << "Error!: " << pq.top() << endl;
     pq.pop();
   }
+  auto t2 = chrono::high_resolution_clock::now();
   cout << "Test Complete" << endl;
+  auto duration = chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
+  cout << "Time: " << duration << endl;
 }
 
 // priority queue test of lazy search tree, insertions uniformly distributed, insertions
-// preceding queries. Doesn't really extract data, just queries the appropriate ranks, which
-// is roughly the same, but slightly faster. Most favorable scenario for LST.
+// preceding extractions of the q smallest elements. Most favorable scenario for LST.
 void pq_speed(int n, int q) {
   lazy_search_tree<int> pq;
+  vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  shuffle(keys.begin(), keys.end(), default_random_engine(0));
   cout << "Begin test" << endl;
+  auto t1 = chrono::high_resolution_clock::now();
   for (int i = 0; i < n; ++i) {
-    pq.insert(i);
+    pq.push(keys[i]);
   }
   for (int i = 0; i < q; ++i) {
-    pq.count(i);
+    if (pq.top() != i) cerr << "Error!: " << pq.top() << endl;
+    pq.pop();
   }
+  auto t2 = chrono::high_resolution_clock::now();
   cout << "Test Complete" << endl;
+  auto duration = chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
+  cout << "Time: " << duration << endl;
 }
 
 // tests for insertions and no queries.
 template <typename container>
-void insert_time_test(container c, long long bound) {
+void insert_time_test(container &c, long long bound) {
   cout << "Begin insert" << endl;
   for (int i = 0; i < bound; ++i) {
     int item = rand() % (1000*bound);
@@ -151,37 +691,65 @@ void insert_time_test(container c, long long bound) {
 
 int main(int argc, char *argv[]) {
   srand(0);
-/*  int n = 100000000;
-  int q = 100;
-  int k = 1;
-  cout << "PQ insert first test n: " << n << " q:" << q << endl;
-  if (argv[1][0] == 'B') {
-    cout << "Time BST" << endl;
-    pq_lib_speed(n, q);
-  } else {
-    cout << "Time LST" << endl;
-    pq_speed(n, q);
-  }*/
   int n = 10000000;
   int q = 25000;
   int k = 1;
   
-  cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
   if (argc != 2) {
-    cout << "Error, Usage: \"./test-harness L\", where L can be B, S, or L" << endl;
+    cout << "Error, Usage: \"./test-harness L\", where L can be B, S, L, F, K, T, A, P, Q, or C" << endl;
+  }
+  else if (argv[1][0] == 'C') {
+    cout << "Correctness tests" << endl;
+    correctness();
+  }
+  else if (argv[1][0] == 'P' || argv[1][0] == 'Q') {
+    int pq_n = 10000000;
+    int pq_q = 100000;
+    cout << "PQ insert first test n: " << pq_n << " q:" << pq_q << endl;
+    if (argv[1][0] == 'P') {
+      cout << "Time c++ priority_queue" << endl;
+      pq_lib_speed(pq_n, pq_q);
+    } else {
+      cout << "Time LST" << endl;
+      pq_speed(pq_n, pq_q);
+    }
   }
   else if (argv[1][0] == 'B') {
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
     cout << "Time c++ set" << endl;
     set<int> bst;
     clustered_speed(n, q, k, bst);
   } else if (argv[1][0] == 'S') {
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
     cout << "Time splay tree" << endl;
     splay_tree<int> stree;
     clustered_speed(n, q, k, stree);
   } else if (argv[1][0] == 'L'){
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
     cout << "Time LST" << endl;
     lazy_search_tree<int> lst;
     clustered_speed(n, q, k, lst);
+  } else if (argv[1][0] == 'F'){
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
+    cout << "Time LST, flat gap index" << endl;
+    lazy_search_tree<int, less<int>, flat_index> lst;
+    clustered_speed(n, q, k, lst);
+  } else if (argv[1][0] == 'K'){
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
+    cout << "Time LST, batched queries" << endl;
+    lazy_search_tree<int> lst;
+    clustered_batch_speed(n, q, k, lst);
+  } else if (argv[1][0] == 'A'){
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
+    cout << "Time LST, adaptive restructuring depth" << endl;
+    lazy_search_tree<int, less<int>, splay_tree, adaptive_depth> lst;
+    clustered_speed(n, q, k, lst);
+  } else if (argv[1][0] == 'T'){
+    cout << "Clustered test n: " << n << " q:" << q << " k:" << k << endl;
+    cout << "Time LST, parallel pivots" << endl;
+    lazy_search_tree<int> lst;
+    lst.use_threads(thread::hardware_concurrency());
+    clustered_speed(n, q, k, lst);
   } else {
     cout << "Argument not recognized" << endl;
   }
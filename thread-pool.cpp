@@ -0,0 +1,136 @@
+// A small work-stealing thread pool for splitting one large operation, such as pivoting a huge
+// interval, across cores. Every worker has its own queue: tasks submitted from a worker go to its
+// own queue and are taken from the back, so recently created work stays on the core that made it,
+// while idle workers steal from the front of the others' queues.
+
+// parallel_for blocks until all of its tasks are done, and the calling thread runs tasks too
+// while it waits. Calls may therefore be nested, or made from a worker, without deadlocking.
+
+#ifndef THREAD_POOL
+#define THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+private:
+  struct queue {
+    std::mutex m;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<queue>> queues;
+  std::vector<std::thread> threads;
+  // queued tasks across all queues, so idle workers know whether to sleep.
+  std::atomic<unsigned long> pending;
+  std::mutex sleep_m;
+  std::condition_variable wake;
+  bool stopping;
+  std::atomic<unsigned> next_queue;
+
+  // the pool the calling thread works for, if any, and its index there.
+  static const thread_pool*& current_pool() {
+    static thread_local const thread_pool *pool = nullptr;
+    return pool;
+  }
+  static unsigned& current_index() {
+    static thread_local unsigned index = 0;
+    return index;
+  }
+
+  void submit(std::function<void()> task) {
+    unsigned q = current_pool() == this ? current_index() : next_queue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(queues[q]->m);
+      queues[q]->tasks.push_back(std::move(task));
+    }
+    ++pending;
+    std::lock_guard<std::mutex> lock(sleep_m);
+    wake.notify_one();
+  }
+
+  // run one task, preferring the newest from queue self and otherwise stealing the oldest from
+  // another queue. Returns false if every queue was empty.
+  bool run_one(unsigned self) {
+    std::function<void()> task;
+    for (unsigned i = 0; i < queues.size() && !task; ++i) {
+      queue &q = *queues[(self + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(q.m);
+      if (q.tasks.empty()) continue;
+      if (i == 0) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+    }
+    if (!task) return false;
+    --pending;
+    task();
+    return true;
+  }
+
+  void work(unsigned index) {
+    current_pool() = this;
+    current_index() = index;
+    for (;;) {
+      if (run_one(index)) continue;
+      std::unique_lock<std::mutex> lock(sleep_m);
+      wake.wait(lock, [this] { return stopping || pending > 0; });
+      if (stopping) return;
+    }
+  }
+
+public:
+  // a pool with n_threads workers, one per hardware thread by default.
+  explicit thread_pool(unsigned n_threads = std::thread::hardware_concurrency())
+      : pending(0), stopping(false), next_queue(0) {
+    n_threads = std::max(n_threads, 1u);
+    for (unsigned i = 0; i < n_threads; ++i) queues.emplace_back(new queue());
+    for (unsigned i = 0; i < n_threads; ++i) threads.emplace_back(&thread_pool::work, this, i);
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  // waits for the workers to finish their current task; queued tasks are dropped.
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_m);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : threads) t.join();
+  }
+
+  unsigned size() const { return threads.size(); }
+
+  // call f(i) for every i in [0, n) in parallel and return once every call has returned.
+  template<typename F>
+  void parallel_for(unsigned long n, F f) {
+    if (n == 0) return;
+    std::atomic<unsigned long> remaining(n);
+    for (unsigned long i = 1; i < n; ++i) {
+      submit([&f, &remaining, i] {
+        f(i);
+        --remaining;
+      });
+    }
+    f(0);
+    --remaining;
+    unsigned self = current_pool() == this ? current_index() : 0;
+    while (remaining > 0) {
+      if (!run_one(self)) std::this_thread::yield();
+    }
+  }
+};
+
+#endif // THREAD_POOL